@@ -0,0 +1,475 @@
+/* Copyright (C) 2020  Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of either:
+
+   * the GNU General Public License as published by
+     the Free Software Foundation; version 2.
+
+   * the GNU General Public License as published by
+     the Free Software Foundation; version 3.
+
+   or both in parallel, as here.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copies of the GNU General Public License,
+   version 2 and 3 along with this program;
+   if not, see <https://www.gnu.org/licenses/>.  */
+
+/* Latency benchmark of tem against the mock Emacs daemon (mock-emacs.c),
+   which has to be found as `emacs' in PATH.  Every invocation of tem runs
+   on its own pseudo terminal, as tem opens terminal frames.  Results are
+   printed as one JSON line per scenario.  The system calls of a warm
+   open are counted with ptrace, and the benchmark fails if there are
+   more of them than allowed.  */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../defines.h"
+
+#define edie(e, ...) (error (EXIT_FAILURE, e, __VA_ARGS__), assume (false))
+
+struct invocation
+{
+  pid_t pid;
+  int master;
+  uint64_t start;
+  uint64_t latency;
+  bool failed;
+};
+
+static const char *e = NULL;
+/* Everything the benchmark leaves behind, the sockets included, is
+   kept in a directory of its own passed to tem as TEM_SOCKET_DIR, so
+   that a running daemon and its statistics are not touched.  */
+static char directory[] = "/tmp/tem-bench-XXXXXX";
+static char mock_log[sizeof (directory) + sizeof ("/mock.log")];
+
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Start E with ARG on a new pseudo terminal, stopped at its exec if
+   TRACED.  */
+static void spawn (struct invocation *invocation, const char *arg, bool traced) __nonnull ((1, 2));
+static void
+spawn (struct invocation *invocation, const char *arg, bool traced)
+{
+  int master = posix_openpt (O_RDWR | O_NOCTTY | O_CLOEXEC);
+  const char *slave_name;
+
+  if (master < 0)
+    edie (errno, "posix_openpt()");
+  if (grantpt (master) != 0 || unlockpt (master) != 0
+      || (slave_name = ptsname (master)) == NULL)
+    edie (errno, "ptsname()");
+
+  invocation->master = master;
+  invocation->start = monotonic_ns ();
+  invocation->pid = fork ();
+  if (invocation->pid < 0)
+    edie (errno, "fork()");
+
+  if (invocation->pid == 0)
+    {
+      int slave;
+      int null;
+
+      setsid ();
+      slave = open (slave_name, O_RDWR);
+      null = open ("/dev/null", O_WRONLY);
+      if (slave < 0 || null < 0)
+        _exit (127);
+      dup2 (slave, STDIN_FILENO);
+      dup2 (slave, STDOUT_FILENO);
+      dup2 (null, STDERR_FILENO);
+      if (traced && ptrace (PTRACE_TRACEME, 0, NULL, NULL) != 0)
+        _exit (127);
+      execl (e, e, arg, (char *) NULL);
+      _exit (127);
+    }
+}
+
+static void finish (struct invocation *invocation, int status) __nonnull ((1));
+static void
+finish (struct invocation *invocation, int status)
+{
+  invocation->latency = monotonic_ns () - invocation->start;
+  invocation->failed = !WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS;
+  close (invocation->master);
+}
+
+/* Run E with ARG and wait for it.  */
+static struct invocation run (const char *arg) __nonnull ((1));
+static struct invocation
+run (const char *arg)
+{
+  struct invocation invocation;
+  int status;
+
+  spawn (&invocation, arg, false);
+  while (waitpid (invocation.pid, &status, 0) < 0)
+    if (errno != EINTR)
+      edie (errno, "waitpid()");
+  finish (&invocation, status);
+
+  return invocation;
+}
+
+/* Run E with ARG and count the system calls it makes after exec in
+   *SYSCALLS.  */
+static struct invocation count_syscalls (const char *arg, size_t *syscalls) __nonnull ((1, 2));
+static struct invocation
+count_syscalls (const char *arg, size_t *syscalls)
+{
+  struct invocation invocation;
+  bool entering = true;
+  int signo = 0;
+  int status;
+
+  *syscalls = 0;
+  spawn (&invocation, arg, true);
+
+  /* The exec stops the child.  */
+  if (waitpid (invocation.pid, &status, 0) < 0)
+    edie (errno, "waitpid()");
+  if (!WIFSTOPPED (status))
+    error (EXIT_FAILURE, 0, "%s did not stop at exec", e);
+  if (ptrace (PTRACE_SETOPTIONS, invocation.pid, NULL,
+              PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) != 0)
+    edie (errno, "ptrace()");
+
+  while (true)
+    {
+      if (ptrace (PTRACE_SYSCALL, invocation.pid, NULL, signo) != 0)
+        edie (errno, "ptrace()");
+      signo = 0;
+
+      while (waitpid (invocation.pid, &status, 0) < 0)
+        if (errno != EINTR)
+          edie (errno, "waitpid()");
+      if (!WIFSTOPPED (status))
+        break;
+
+      /* Every system call stops on entry and on exit.  */
+      if (WSTOPSIG (status) == (SIGTRAP | 0x80))
+        {
+          *syscalls += entering;
+          entering = !entering;
+        }
+      else
+        signo = WSTOPSIG (status);
+    }
+  finish (&invocation, status);
+
+  return invocation;
+}
+
+static int
+compare_uint64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile (const uint64_t *sorted, size_t n, unsigned int percent)
+{
+  return sorted[(n * percent + 99) / 100 - 1];
+}
+
+/* Print the summary of N INVOCATIONS of SCENARIO, followed by EXTRA
+   JSON members if any.  */
+static void report (const char *scenario, const struct invocation *invocations, size_t n, const char *extra) __nonnull ((1, 2));
+static void
+report (const char *scenario, const struct invocation *invocations, size_t n, const char *extra)
+{
+  uint64_t *latencies;
+  uint64_t sum = 0;
+  size_t failures = 0;
+
+  if (n == 0)
+    return;
+
+  latencies = calloc (n, sizeof (*latencies));
+  if (latencies == NULL)
+    edie (errno, "calloc()");
+
+  for (size_t i = 0; i < n; i++)
+    {
+      latencies[i] = invocations[i].latency;
+      sum += latencies[i];
+      failures += invocations[i].failed;
+    }
+  qsort (latencies, n, sizeof (*latencies), compare_uint64);
+
+  printf ("{\"scenario\":\"%s\",\"n\":%zu,\"failures\":%zu,\"mean_ns\":%" PRIu64
+          ",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+          ",\"max_ns\":%" PRIu64 "%s%s}\n",
+          scenario, n, failures, sum / n,
+          percentile (latencies, n, 50), percentile (latencies, n, 90),
+          percentile (latencies, n, 99), latencies[n - 1],
+          (extra != NULL ? "," : ""), (extra != NULL ? extra : ""));
+  fflush (stdout);
+
+  free (latencies);
+}
+
+static struct invocation *allocate (size_t n) __returns_nonnull;
+static struct invocation *
+allocate (size_t n)
+{
+  struct invocation *invocations = calloc (n + 1, sizeof (*invocations));
+  if (invocations == NULL)
+    edie (errno, "calloc()");
+  return invocations;
+}
+
+static bool
+daemon_running (void)
+{
+  struct sockaddr_un address;
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool running;
+
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  sprintf (address.sun_path, "%s/%u/socket", directory, geteuid ());
+  running = connect (fd, (struct sockaddr *) &address, sizeof (address)) == 0;
+  close (fd);
+
+  return running;
+}
+
+static size_t
+daemons_started (void)
+{
+  FILE *stream = fopen (mock_log, "r");
+  size_t n = 0;
+  int c;
+
+  if (stream == NULL)
+    return 0;
+  while ((c = getc (stream)) != EOF)
+    n += c == '\n';
+  fclose (stream);
+
+  return n;
+}
+
+static int
+remove_file (const char *name, const struct stat *sb, int type, struct FTW *ftw)
+{
+  (void) sb, (void) type, (void) ftw;
+  remove (name);
+  return 0;
+}
+
+static void
+stop (void)
+{
+  if (daemon_running ())
+    run ("--stopd");
+}
+
+static __noreturn void
+usage (int status)
+{
+  fputs ("\
+Usage: bench [OPTIONS] E\n\
+Measure latency of tem binary E against the mock Emacs daemon.\n\
+\n\
+  -w N    Number of warm opens (default: 200).\n\
+  -c N    Number of cold starts (default: 10).\n\
+  -r N    Number of --restartd (default: 10).\n\
+  -s N    Number of --stopd (default: 10).\n\
+  -S N    Number of concurrent invocations for the stress test,\n\
+          started without a running daemon (default: 1000).\n\
+  -m N    Most system calls a warm open may make (default: 50,\n\
+          0 means no limit).\n\
+\n\
+Delays of the mock daemon are set by TEM_MOCK_INIT_DELAY and\n\
+TEM_MOCK_REPLY_DELAY in milliseconds.\n\
+",
+         (status == EXIT_SUCCESS ? stdout : stderr));
+  exit (status);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t warm = 200;
+  size_t cold = 10;
+  size_t restarts = 10;
+  size_t stops = 10;
+  size_t stress = 1000;
+  size_t max_syscalls = 50;
+  size_t syscalls;
+  struct invocation traced;
+  struct invocation *invocations;
+  char extra[128];
+  int c;
+  int fd;
+
+  while ((c = getopt (argc, argv, "w:c:r:s:S:m:h")) != -1)
+    switch (c)
+      {
+      case 'w':
+        warm = strtoul (optarg, NULL, 10);
+        break;
+      case 'c':
+        cold = strtoul (optarg, NULL, 10);
+        break;
+      case 'r':
+        restarts = strtoul (optarg, NULL, 10);
+        break;
+      case 's':
+        stops = strtoul (optarg, NULL, 10);
+        break;
+      case 'S':
+        stress = strtoul (optarg, NULL, 10);
+        break;
+      case 'm':
+        max_syscalls = strtoul (optarg, NULL, 10);
+        break;
+      case 'h':
+        usage (EXIT_SUCCESS);
+      default:
+        usage (EXIT_FAILURE);
+      }
+  if (optind + 1 != argc)
+    usage (EXIT_FAILURE);
+  e = argv[optind];
+
+  if (mkdtemp (directory) == NULL)
+    edie (errno, "mkdtemp()");
+  setenv ("TEM_SOCKET_DIR", directory, true);
+  sprintf (mock_log, "%s/mock.log", directory);
+  fd = open (mock_log, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0)
+    edie (errno, "%s", mock_log);
+  close (fd);
+  setenv ("TEM_MOCK_LOG", mock_log, true);
+  if (getenv ("TERM") == NULL)
+    setenv ("TERM", "xterm", true);
+
+  unsetenv ("TEM_SOCKET_ACTIVATION");
+  invocations = allocate (cold);
+  for (size_t i = 0; i < cold; i++)
+    {
+      invocations[i] = run ("bench-file");
+      stop ();
+    }
+  report ("cold_start", invocations, cold, NULL);
+
+  /* The same with the socket bound before the init file is loaded.  */
+  setenv ("TEM_SOCKET_ACTIVATION", "1", true);
+  for (size_t i = 0; i < cold; i++)
+    {
+      invocations[i] = run ("bench-file");
+      stop ();
+    }
+  unsetenv ("TEM_SOCKET_ACTIVATION");
+  report ("cold_start_activated", invocations, cold, NULL);
+  free (invocations);
+
+  invocations = allocate (warm);
+  run ("bench-file");
+  for (size_t i = 0; i < warm; i++)
+    invocations[i] = run ("bench-file");
+  report ("warm_open", invocations, warm, NULL);
+  free (invocations);
+
+  traced = count_syscalls ("bench-file", &syscalls);
+  sprintf (extra, "\"syscalls\":%zu", syscalls);
+  report ("warm_syscalls", &traced, 1, extra);
+
+  invocations = allocate (restarts);
+  for (size_t i = 0; i < restarts; i++)
+    invocations[i] = run ("--restartd");
+  report ("restartd", invocations, restarts, NULL);
+  free (invocations);
+
+  invocations = allocate (stops);
+  for (size_t i = 0; i < stops; i++)
+    {
+      run ("bench-file");
+      invocations[i] = run ("--stopd");
+    }
+  report ("stopd", invocations, stops, NULL);
+  free (invocations);
+
+  if (stress > 0)
+    {
+      size_t daemons;
+      size_t done = 0;
+      uint64_t start;
+
+      stop ();
+      daemons = daemons_started ();
+      invocations = allocate (stress);
+
+      start = monotonic_ns ();
+      for (size_t i = 0; i < stress; i++)
+        spawn (&invocations[i], "bench-file", false);
+      while (done < stress)
+        {
+          int status;
+          pid_t pid = waitpid (-1, &status, 0);
+
+          if (pid < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              edie (errno, "waitpid()");
+            }
+          for (size_t i = 0; i < stress; i++)
+            if (invocations[i].pid == pid)
+              {
+                finish (&invocations[i], status);
+                done++;
+                break;
+              }
+        }
+
+      sprintf (extra, "\"wall_ns\":%" PRIu64 ",\"daemons\":%zu",
+               monotonic_ns () - start, daemons_started () - daemons);
+      report ("stress", invocations, stress, extra);
+      free (invocations);
+    }
+
+  stop ();
+  nftw (directory, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+
+  if (max_syscalls != 0 && syscalls > max_syscalls)
+    error (EXIT_FAILURE, 0, "a warm open made %zu system calls, more than %zu",
+           syscalls, max_syscalls);
+
+  return EXIT_SUCCESS;
+}
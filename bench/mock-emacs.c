@@ -0,0 +1,323 @@
+/* Copyright (C) 2020  Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of either:
+
+   * the GNU General Public License as published by
+     the Free Software Foundation; version 2.
+
+   * the GNU General Public License as published by
+     the Free Software Foundation; version 3.
+
+   or both in parallel, as here.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copies of the GNU General Public License,
+   version 2 and 3 along with this program;
+   if not, see <https://www.gnu.org/licenses/>.  */
+
+/* A stand-in for `emacs --daemon=NAME' used by the benchmarks.  It
+   behaves like the Emacs server as far as tem can see: the foreground
+   process exits once the daemon listens on NAME, requests are served one
+   at a time, every request is answered with -emacs-pid, -eval requests
+   with -print, and (kill-emacs) removes the socket and exits.  It has
+   a single buffer and no frames, and never collects garbage.  It is
+   never in use, as far as the idle check of the watchdog can tell.
+   `emacs --batch ... --eval (dump-emacs-portable "FILE")' creates FILE.
+   With --fg-daemon=NAME it does not fork, and uses the socket passed
+   through LISTEN_PID and LISTEN_FDS instead of binding NAME.
+
+   The following environment variables are understood:
+     TEM_MOCK_INIT_DELAY   Milliseconds to "load the init file" (200).
+     TEM_MOCK_DUMP_DELAY   The same when started with --dump-file (20).
+     TEM_MOCK_REPLY_DELAY  Milliseconds to think before every reply (0).
+     TEM_MOCK_LOG          File to append "start PID" to for every daemon.  */
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../defines.h"
+
+#define edie(e, ...) (error (EXIT_FAILURE, e, __VA_ARGS__), assume (false))
+
+static char *server_name = NULL;
+
+static unsigned long
+getenv_milliseconds (const char *name, unsigned long fallback)
+{
+  const char *value = getenv (name);
+  return value != NULL && *value != '\0' ? strtoul (value, NULL, 10) : fallback;
+}
+
+static void
+sleep_milliseconds (unsigned long ms)
+{
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 };
+  while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+    continue;
+}
+
+static void write_all (int fd, const char *data, size_t length) __nonnull ((2));
+static void
+write_all (int fd, const char *data, size_t length)
+{
+  while (length > 0)
+    {
+      ssize_t n = send (fd, data, length, MSG_NOSIGNAL);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          /* The client went away, nothing to do about it.  */
+          return;
+        }
+      data += n;
+      length -= n;
+    }
+}
+
+/* Extract the argument of the first COMMAND in REQUEST, unquoted.  */
+static char *find_argument (char *request, const char *command) __nonnull ((1, 2));
+static char *
+find_argument (char *request, const char *command)
+{
+  char *p;
+  char *q;
+  char *argument;
+
+  for (p = strtok (request, " "); p != NULL; p = strtok (NULL, " "))
+    if (streq (p, command))
+      break;
+  if (p == NULL || (argument = strtok (NULL, " ")) == NULL)
+    return NULL;
+
+  for (p = q = argument; *p != '\0'; p++)
+    {
+      if (*p == '&' && p[1] != '\0')
+        {
+          p++;
+          *q++ = *p == '_' ? ' ' : *p == 'n' ? '\n' : *p;
+        }
+      else
+        *q++ = *p;
+    }
+  *q = '\0';
+
+  return argument;
+}
+
+/* Handle a single REQUEST line on connection FD.  */
+static void handle_request (int fd, char *request, unsigned long reply_delay) __nonnull ((2));
+static void
+handle_request (int fd, char *request, unsigned long reply_delay)
+{
+  char reply[BUFSIZ];
+  char *expression;
+  int n;
+
+  sleep_milliseconds (reply_delay);
+
+  n = sprintf (reply, "-emacs-pid %d\n", getpid ());
+  write_all (fd, reply, n);
+
+  expression = find_argument (request, "-eval");
+  if (expression == NULL)
+    return;
+
+  /* Nobody else is ever connected, so the daemon is never in use.  */
+  if (strstr (expression, "(kill-emacs)") != NULL)
+    {
+      close (fd);
+      unlink (server_name);
+      exit (EXIT_SUCCESS);
+    }
+
+  if (strprefix (expression, "(setq server-name \""))
+    {
+      char *name = expression + strlen ("(setq server-name \"");
+      char *end = strrchr (name, '"');
+      if (end != NULL)
+        {
+          *end = '\0';
+          free (server_name);
+          server_name = strdup (name);
+        }
+    }
+
+  if (strstr (expression, "'idle)") != NULL)
+    write_all (fd, "-print idle\n", strlen ("-print idle\n"));
+  else if (strstr (expression, "gcs-done") != NULL)
+    write_all (fd, "-print (1&_0&_0&_0&_0.0)\n", strlen ("-print (1&_0&_0&_0&_0.0)\n"));
+  else
+    write_all (fd, "-print nil\n", strlen ("-print nil\n"));
+}
+
+static __noreturn void
+serve (int server, unsigned long reply_delay)
+{
+  static char request[1 << 20];
+
+  while (true)
+    {
+      size_t length = 0;
+      int fd = accept4 (server, NULL, NULL, SOCK_CLOEXEC);
+
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          edie (errno, "accept()");
+        }
+
+      /* Read a whole request line; liveness probes send nothing.  The
+         tail of a request too long for the buffer is dropped.  */
+      while (true)
+        {
+          size_t offset = length < sizeof (request) - 1 ? length : 0;
+          ssize_t n = recv (fd, request + offset, sizeof (request) - 1 - offset, 0);
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n <= 0)
+            break;
+          if (offset == length)
+            length += n;
+          if (request[offset + n - 1] == '\n')
+            break;
+        }
+      request[length] = '\0';
+
+      if (length > 0)
+        handle_request (fd, request, reply_delay);
+      close (fd);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  int fd;
+  int server;
+  int pipe_fds[2];
+  char ready;
+  const char *log;
+  const char *listen_pid;
+  struct sockaddr_un address;
+
+  bool dumped = false;
+  bool foreground = false;
+
+  for (int i = 1; i < argc; i++)
+    if (strprefix (argv[i], "--daemon="))
+      server_name = strdup (argv[i] + strlen ("--daemon="));
+    else if (strprefix (argv[i], "--fg-daemon="))
+      {
+        server_name = strdup (argv[i] + strlen ("--fg-daemon="));
+        foreground = true;
+      }
+    else if (strprefix (argv[i], "--dump-file="))
+      dumped = true;
+    else if (strprefix (argv[i], "(dump-emacs-portable \""))
+      {
+        char *image = argv[i] + strlen ("(dump-emacs-portable \"");
+        *strrchr (image, '"') = '\0';
+        fd = open (image, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        return fd >= 0 && close (fd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+  if (server_name == NULL)
+    error (EXIT_FAILURE, 0, "only --daemon=NAME and --fg-daemon=NAME are supported");
+
+  /* Like Emacs, take the socket before forking.  */
+  server = -1;
+  listen_pid = getenv ("LISTEN_PID");
+  if (listen_pid != NULL && strtol (listen_pid, NULL, 10) == getpid ()
+      && getenv ("LISTEN_FDS") != NULL && streq (getenv ("LISTEN_FDS"), "1"))
+    server = 3;
+  unsetenv ("LISTEN_PID");
+  unsetenv ("LISTEN_FDS");
+
+  if (pipe (pipe_fds) != 0)
+    edie (errno, "pipe()");
+
+  switch (foreground ? 0 : fork ())
+    {
+    case -1:
+      edie (errno, "fork()");
+    case 0:
+      break;
+    default:
+      /* Like Emacs, the foreground process exits once the daemon is
+         ready to serve.  */
+      close (pipe_fds[1]);
+      return read (pipe_fds[0], &ready, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  close (pipe_fds[0]);
+  if (!foreground)
+    setsid ();
+  signal (SIGHUP, SIG_IGN);
+
+  log = getenv ("TEM_MOCK_LOG");
+  if (log != NULL && *log != '\0')
+    {
+      FILE *stream = fopen (log, "a");
+      if (stream != NULL)
+        {
+          fprintf (stream, "start %d\n", getpid ());
+          fclose (stream);
+        }
+    }
+
+  sleep_milliseconds (dumped
+                      ? getenv_milliseconds ("TEM_MOCK_DUMP_DELAY", 20)
+                      : getenv_milliseconds ("TEM_MOCK_INIT_DELAY", 200));
+
+  if (server < 0)
+    {
+      if (strlen (server_name) >= sizeof (address.sun_path))
+        edie (ENAMETOOLONG, "%s", server_name);
+      memset (&address, 0, sizeof (address));
+      address.sun_family = AF_UNIX;
+      strcpy (address.sun_path, server_name);
+
+      server = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (server < 0)
+        edie (errno, "socket()");
+      unlink (server_name);
+      if (bind (server, (struct sockaddr *) &address, sizeof (address)) != 0)
+        edie (errno, "bind(%s)", server_name);
+      if (listen (server, SOMAXCONN) != 0)
+        edie (errno, "listen()");
+    }
+
+  ready = 1;
+  if (!foreground && write (pipe_fds[1], &ready, 1) != 1)
+    edie (errno, "write()");
+  close (pipe_fds[1]);
+
+  /* Detach from the terminal of whoever started us.  */
+  fd = open ("/dev/null", O_RDWR);
+  if (fd >= 0)
+    {
+      dup2 (fd, STDIN_FILENO);
+      dup2 (fd, STDOUT_FILENO);
+      dup2 (fd, STDERR_FILENO);
+      close (fd);
+    }
+
+  serve (server, getenv_milliseconds ("TEM_MOCK_REPLY_DELAY", 0));
+}
@@ -193,6 +193,7 @@ __builtin_mul_overflow (size_t a, size_t b, size_t *c)
 
 #define streq(s1, s2)     (strcmp ((s1), (s2)) == 0)
 #define strneq(s1, s2, n) (strncmp ((s1), (s2), n) == 0)
+#define strprefix(s, prefix) strneq (s, prefix, strlen (prefix))
 
 #define stringify(x) #x
 #define __glue(s1, s2) s1 ## s2
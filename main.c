@@ -28,19 +28,33 @@
 #include <error.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <paths.h>
+#include <poll.h>
+#include <sched.h>
 #include <pwd.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "defines.h"
@@ -56,8 +70,40 @@
 #define TERMINATED(status) (WIFEXITED (status) || WIFSIGNALED (status))
 
 static uid_t uid;
+static pid_t emacs_pid = 0;
+
+/* The name of the daemon set by --name or derived from the project of
+   the first FILE by --project.  NULL for the default daemon.  */
+static const char *daemon_name = NULL;
+static bool route_by_project = false;
+static char *socket_directory = NULL;
 static char *socket_name = NULL;
 
+/* The directory of the per-user socket directories, unless TEM_SOCKET_DIR
+   names another one.  */
+#define EMACS_SOCKET_DIRECTORY "/tmp/.emacs-sockets"
+
+/* Storage of socket_directory and socket_name, so that the warm path
+   does not allocate.  */
+static char socket_directory_buffer[sizeof (((struct sockaddr_un *) NULL)->sun_path)];
+static char socket_name_buffer[sizeof (((struct sockaddr_un *) NULL)->sun_path)];
+
+/* How long to wait for a freshly started daemon to accept connections,
+   in milliseconds.  Zero means to wait forever.  */
+static uint64_t daemon_start_timeout = 60 * 1000;
+
+/* Whether --restartd should leave a pre-warmed spare daemon behind.  */
+static bool keep_spare = false;
+
+/* Whether --from-stdin was given to read more FILEs from stdin.  */
+static bool from_stdin = false;
+
+/* The file standard input is copied to when it is given as "-" and is
+   not a regular file, while the producer is still writing to it.  */
+static int stdin_copy = -1;
+static loff_t stdin_copy_length = 0;
+static bool stdin_streaming = false;
+
 static void *xmallocarray (size_t n, size_t m) __malloc __alloc_size ((1)) __returns_nonnull __warn_unused_result;
 static void *
 xmalloc (size_t s)
@@ -79,7 +125,6 @@ xmallocarray (size_t n, size_t m)
   return xmalloc (s);
 }
 
-#if 0
 static void *xreallocarray (void *pointer, size_t n, size_t m) __malloc __nonnull ((1)) __alloc_size ((2, 3)) __returns_nonnull __warn_unused_result;
 static void *
 xreallocarray (void *pointer, size_t n, size_t m)
@@ -93,8 +138,8 @@ xreallocarray (void *pointer, size_t n, size_t m)
     edie (errno, "realloc()");
   return pointer;
 }
-#endif
 
+#if 0
 static pid_t xfork (void) __warn_unused_result;
 static pid_t
 xfork (void)
@@ -104,31 +149,91 @@ xfork (void)
     edie (errno, "fork()");
   return pid;
 }
+#endif
 
-static void xwaitpid (pid_t pid, int *status, int flags) __nonnull ((2));
-static void
+/* Start FILE found in PATH with ARGV, in a new session if NEW_SESSION,
+   with its standard output and error redirected to OUTPUT unless it is
+   negative.  glibc implements posix_spawn with clone (CLONE_VM |
+   CLONE_VFORK), so the page tables of a large parent are never copied,
+   and exec failures are reported here rather than in the child.  */
+static pid_t xspawnp (const char *file, char **argv, bool new_session, int output) __nonnull ((1, 2)) __warn_unused_result;
+static pid_t
+xspawnp (const char *file, char **argv, bool new_session, int output)
+{
+  int e;
+  pid_t pid;
+  posix_spawnattr_t attributes;
+  posix_spawn_file_actions_t actions;
+
+  if (unlikely ((e = posix_spawnattr_init (&attributes)) != 0))
+    edie (e, "posix_spawnattr_init()");
+  if (new_session
+      && unlikely ((e = posix_spawnattr_setflags (&attributes, POSIX_SPAWN_SETSID)) != 0))
+    edie (e, "posix_spawnattr_setflags()");
+
+  if (unlikely ((e = posix_spawn_file_actions_init (&actions)) != 0))
+    edie (e, "posix_spawn_file_actions_init()");
+  if (output >= 0
+      && unlikely ((e = posix_spawn_file_actions_adddup2 (&actions, output, STDOUT_FILENO)) != 0
+                   || (e = posix_spawn_file_actions_adddup2 (&actions, output, STDERR_FILENO)) != 0))
+    edie (e, "posix_spawn_file_actions_adddup2()");
+
+  e = posix_spawnp (&pid, file, &actions, &attributes, argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  posix_spawnattr_destroy (&attributes);
+  if (unlikely (e != 0))
+    edie (e, "posix_spawnp(%s)", file);
+
+  return pid;
+}
+
+/* Return a file descriptor that becomes readable when PID terminates,
+   or -1 if the kernel does not support pidfds.  */
+static int pidfd_of (pid_t pid) __warn_unused_result;
+static int
+pidfd_of (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  /* Pidfds are always close-on-exec.  */
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  (void) pid;
+  return -1;
+#endif
+}
+
+static pid_t xwaitpid (pid_t pid, int *status, int flags) __nonnull ((2));
+static pid_t
 xwaitpid (pid_t pid, int *status, int flags)
 {
-  while (unlikely (waitpid (pid, status, flags) < 0))
+  pid_t r;
+  while (unlikely ((r = waitpid (pid, status, flags)) < 0))
     if (unlikely (errno != EINTR))
       edie (errno, "waitpid()");
+  return r;
 }
 
+static void write_trace (void);
+
 static void xexecvp (char *file, char **argv) __noreturn __nonnull ((1, 2));
 static void
 xexecvp (char *file, char **argv)
 {
+  /* atexit() handlers do not run on exec.  */
+  write_trace ();
   execvp (file, argv);
   /* Unreachable on success.  */
   edie (errno, "execvp()");
 }
 
+#if 0
 static void
 xraise (int signo)
 {
   if (unlikely (raise (signo) != 0))
     edie (errno, "raise(%d)", signo);
 }
+#endif
 
 static void
 xkill (pid_t pid, int signo)
@@ -226,6 +331,16 @@ xastrcat (char **d, const char *s)
 }
 #endif
 
+static uint64_t monotonic_ns (void) __warn_unused_result;
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+  if (unlikely (clock_gettime (CLOCK_MONOTONIC, &ts) != 0))
+    edie (errno, "clock_gettime()");
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static uid_t xgeteuid (void) __warn_unused_result;
 static uid_t
 xgeteuid (void)
@@ -241,259 +356,4915 @@ xgeteuid (void)
   return euid;
 }
 
-poison (malloc calloc realloc fork kill raise execvp waitpid);
-poison (chmod mkdir sprintf snprintf asprintf getuid geteuid);
+/* Return a newly allocated name of the file NAME in socket_directory.  */
+static char *socket_directory_file (const char *name) __nonnull ((1)) __returns_nonnull __warn_unused_result;
+static char *
+socket_directory_file (const char *name)
+{
+  char *file_name = xmalloc (strlen (socket_directory) + 1 + strlen (name) + 1);
+  xsprintf (file_name, "%s/%s", socket_directory, name);
+  return file_name;
+}
 
-static int wait_program_termination (pid_t pid) __warn_unused_result;
-static int
-wait_program_termination (pid_t pid)
+/* Return a newly allocated name of the file that belongs to the daemon
+   listening on socket_name: its lock, its spare and so on.  */
+static char *socket_file (const char *suffix) __nonnull ((1)) __returns_nonnull __warn_unused_result;
+static char *
+socket_file (const char *suffix)
 {
-  int status;
-  do
-    xwaitpid (pid, &status, 0);
-  while (unlikely (!TERMINATED (status)));
-  return status;
+  char *file_name = xmalloc (strlen (socket_name) + strlen (suffix) + 1);
+  xsprintf (file_name, "%s%s", socket_name, suffix);
+  return file_name;
 }
 
-poison (xwaitpid);
+/* Remove the I-th argument from ARGV.  */
+static void remove_argument (int *argc, char **argv, int i) __nonnull ((1, 2));
+static void
+remove_argument (int *argc, char **argv, int i)
+{
+  memmove (argv + i, argv + i + 1, (*argc - i) * sizeof (*argv));
+  (*argc)--;
+}
 
-static bool socket_exists (const char *socket_name) __nonnull ((1)) __warn_unused_result;
-static bool
-socket_exists (const char *socket_name)
+/* Parse VALUE of OPTION as a non-negative number of seconds and return
+   it in milliseconds.  */
+static uint64_t parse_seconds (const char *option, const char *value) __nonnull ((1, 2)) __warn_unused_result;
+static uint64_t
+parse_seconds (const char *option, const char *value)
 {
-  struct stat sb;
+  char *end;
+  double seconds;
 
-  if (stat (socket_name, &sb) != 0)
-    {
-      if (errno == ENOENT)
-        return false;
-      else
-        edie (errno, "stat(%s)", socket_name);
-    }
+  errno = 0;
+  seconds = strtod (value, &end);
+  if (unlikely (errno != 0 || end == value || *end != '\0'
+                || !(seconds >= 0) || seconds > UINT32_MAX))
+    edie (errno != 0 ? errno : EINVAL, "%s", option);
 
-  if (unlikely (!S_ISSOCK (sb.st_mode)))
-    edie (ENOTSOCK, "%s", socket_name);
+  return seconds * 1000;
+}
 
-  /* There is a socket in our directory,
-     but this socket is not owned by us.  */
-  if (unlikely (sb.st_uid != uid))
-    die (EXIT_FAILURE, "The socket does not belong to us.\n");
+/* Parse VALUE of OPTION as a non-negative number of bytes, optionally
+   followed by a K, M or G multiplier.  */
+static uint64_t parse_size (const char *option, const char *value) __nonnull ((1, 2)) __warn_unused_result;
+static uint64_t
+parse_size (const char *option, const char *value)
+{
+  char *end;
+  uint64_t size;
+  int shift = 0;
+
+  errno = 0;
+  size = strtoumax (value, &end, 10);
+  if (end != value && end[0] != '\0' && end[1] == '\0')
+    switch (*end++)
+      {
+      case 'G':
+        shift += 10;
+        /* Fallthrough.  */
+      case 'M':
+        shift += 10;
+        /* Fallthrough.  */
+      case 'K':
+        shift += 10;
+        break;
+      default:
+        end--;
+        break;
+      }
+  if (unlikely (errno != 0 || end == value || *end != '\0' || value[0] == '-'
+                || size > (UINT64_MAX >> shift)))
+    edie (errno != 0 ? errno : EINVAL, "%s", option);
 
-  return (faccessat (AT_FDCWD, socket_name, X_OK, AT_EACCESS) == 0);
+  return size << shift;
 }
 
-static char *get_alternate_editor (void) __returns_nonnull __warn_unused_result;
-static char *
-get_alternate_editor (void)
+/* Parse VALUE of OPTION as a cgroup weight, from 1 to 10000.  */
+static unsigned long parse_weight (const char *option, const char *value) __nonnull ((1, 2)) __warn_unused_result;
+static unsigned long
+parse_weight (const char *option, const char *value)
 {
-  char *alternate_editor = getenv ("ALTERNATE_EDITOR");
-  return alternate_editor != NULL ? alternate_editor : (char *) "";
+  char *end;
+  unsigned long weight;
+
+  errno = 0;
+  weight = strtoul (value, &end, 10);
+  if (unlikely (errno != 0 || end == value || *end != '\0'
+                || weight < 1 || weight > 10000))
+    edie (errno != 0 ? errno : EINVAL, "%s", option);
+
+  return weight;
 }
 
-static void
-start_daemon (bool do_fork, int argc, char **argv)
+/* Phase tracing.  Phases are always timed for the latency statistics
+   below.  With --trace=FILE or TEM_TRACE=FILE every invocation also
+   appends a single JSON line to FILE with the CLOCK_MONOTONIC nanosecond
+   timestamps of its phases and the PIDs of its children.  */
+
+#define TRACE_MAX_PHASES 64
+
+struct trace_phase
 {
+  const char *name;
+  uint64_t start;
+  uint64_t end;
   pid_t pid;
-  int status;
+};
 
-  pid = do_fork ? xfork () : 0;
-  if (pid == 0)
-    {
-      int i;
-      int c;
-      char **v;
-      char *d;
+static const char *trace_file = NULL;
+static pid_t trace_owner = 0;
+static uint64_t trace_start = 0;
+static size_t trace_phase_count = 0;
+static struct trace_phase trace_phases[TRACE_MAX_PHASES];
 
-      d = xmalloc (strlen ("--daemon=") + strlen (socket_name) + 1);
-      xsprintf (d, "--daemon=%s", socket_name);
+/* Start the phase NAME and return its handle for trace_end().  */
+static int trace_begin (const char *name) __nonnull ((1));
+static int
+trace_begin (const char *name)
+{
+  struct trace_phase *phase;
 
-      c = 0;
-      v = xmallocarray (argc + 2, sizeof (*v));
+  if (unlikely (trace_phase_count == TRACE_MAX_PHASES))
+    return -1;
 
-      v[c++] = "emacs";
-      v[c++] = d;
+  phase = &trace_phases[trace_phase_count];
+  phase->name = name;
+  phase->start = monotonic_ns ();
+  phase->end = 0;
+  phase->pid = 0;
 
-      i = 1;
-      while (i < argc)
-        v[c++] = argv[i++];
-      v[c] = NULL;
+  return trace_phase_count++;
+}
+
+static void
+trace_end (int phase)
+{
+  if (phase >= 0)
+    trace_phases[phase].end = monotonic_ns ();
+}
+
+/* Record that the phase has started the child process PID.  */
+static void
+trace_pid (int phase, pid_t pid)
+{
+  if (phase >= 0)
+    trace_phases[phase].pid = pid;
+}
+
+static void
+write_trace (void)
+{
+  int fd;
+  FILE *stream;
+  uint64_t end;
+  char buffer[BUFSIZ];
 
-      setsid ();
+  /* Forked children must not write the trace of their parent.  */
+  if (likely (trace_file == NULL) || getpid () != trace_owner)
+    return;
 
-      xexecvp (v[0], v);
+  end = monotonic_ns ();
+
+  fd = open (trace_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (unlikely (fd < 0) || unlikely ((stream = fdopen (fd, "a")) == NULL))
+    {
+      error (0, errno, "%s", trace_file);
+      if (fd >= 0)
+        close (fd);
+      trace_file = NULL;
+      return;
     }
 
-  status = wait_program_termination (pid);
+  /* Let the whole line go out with a single write(), so that lines of
+     concurrent invocations do not interleave.  */
+  setvbuf (stream, buffer, _IOFBF, sizeof (buffer));
 
-  if (unlikely (EXITED_UNSUCCESSFULLY (status)))
-    die (EXIT_FAILURE, "Failed to start daemon.\n");
+  fprintf (stream, "{\"pid\":%d,\"start\":%" PRIu64 ",\"end\":%" PRIu64
+           ",\"total_ns\":%" PRIu64 ",\"emacs_pid\":%d,\"phases\":[",
+           trace_owner, trace_start, end, end - trace_start, emacs_pid);
+  for (size_t i = 0; i < trace_phase_count; i++)
+    {
+      struct trace_phase *phase = &trace_phases[i];
+      uint64_t phase_end = phase->end != 0 ? phase->end : end;
+
+      fprintf (stream, "%s{\"phase\":\"%s\",\"start\":%" PRIu64
+               ",\"end\":%" PRIu64 ",\"ns\":%" PRIu64,
+               (i == 0 ? "" : ","), phase->name, phase->start, phase_end,
+               phase_end - phase->start);
+      if (phase->pid != 0)
+        fprintf (stream, ",\"pid\":%d", phase->pid);
+      fputc ('}', stream);
+    }
+  fputs ("]}\n", stream);
+
+  if (unlikely (fclose (stream) != 0))
+    error (0, errno, "%s", trace_file);
+
+  /* Write the trace only once.  */
+  trace_file = NULL;
 }
-static void
-start_client (int argc, char **argv)
+
+/* Latency statistics.  Every invocation appends its total and per-phase
+   latency to a ring buffer in the memory-mapped file "stats" in the
+   socket directory, which --stats summarizes.  Appends are lock-free:
+   a writer claims a slot by atomically incrementing the index and
+   publishes the record by storing its sequence number last.  */
+
+/* Change the last character whenever the layout changes.  */
+#define STATS_MAGIC 0x54454d31 /* "TEM1" */
+#define STATS_RECORDS 2048
+#define STATS_PHASES 9
+
+enum stats_kind
 {
-  int i;
-  int c;
-  char **v;
+  STATS_WARM,
+  STATS_COLD,
+  STATS_RESTART,
+  STATS_STOP,
+  STATS_KINDS
+};
 
-  c = 0;
-  v = xmallocarray (argc + 7, sizeof (*v));
+static const char *const stats_kind_names[STATS_KINDS] =
+  { "warm open", "cold start", "restart", "stop" };
+static const char *const stats_phase_names[STATS_PHASES] =
+  { "setup", "probe", "lock", "spawn", "wait", "connect", "request", "reply", "eval" };
 
-  v[c++] = "emacsclient";
-  v[c++] = "-t";
-  v[c++] = "-q";
-  v[c++] = "-s";
-  v[c++] = socket_name;
-  v[c++] = "-a";
-  v[c++] = get_alternate_editor ();
+struct stats_record
+{
+  /* Index of the append plus one, zero while the record is written.  */
+  uint64_t sequence;
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t total;
+  uint64_t phases[STATS_PHASES];
+};
 
-  /* Copy the rest arguments.  */
-  i = 1;
-  while (i < argc)
-    v[c++] = argv[i++];
-  v[c] = NULL;
+struct stats_ring
+{
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t next;
+  struct stats_record records[STATS_RECORDS];
+};
 
-  xexecvp (v[0], v);
-}
-static void
-stop_daemon (bool do_fork)
+/* Map the ring buffer, creating it if needed.  Return NULL if it can
+   not be used; statistics are never worth failing an invocation.  */
+static struct stats_ring *map_stats (bool writable) __warn_unused_result;
+static struct stats_ring *
+map_stats (bool writable)
 {
-  pid_t pid;
-  int status;
+  int fd;
+  struct stat sb;
+  char stats_name[sizeof (socket_directory_buffer) + sizeof ("/stats")];
+  struct stats_ring *ring = NULL;
+  uint32_t magic = 0;
+
+  xsprintf (stats_name, "%s/stats", socket_directory);
+  fd = open (stats_name, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &sb) != 0)
+    goto out;
 
-  pid = do_fork ? xfork () : 0;
-  if (pid == 0)
+  if (sb.st_size != sizeof (*ring))
     {
-      char *v[6];
-      v[0] = "emacsclient";
-      v[1] = "-s";
-      v[2] = socket_name;
-      v[3] = "--eval";
-      v[4] = "(progn (kill-emacs))";
-      v[5] = NULL;
+      /* Zero-filled file is an empty ring, and concurrent initializers
+         all truncate it to the same size.  */
+      if (!writable || sb.st_size != 0 || ftruncate (fd, sizeof (*ring)) != 0)
+        goto out;
+    }
 
-      if (unlikely (!socket_exists (socket_name)))
-        die (EXIT_SUCCESS, "Emacs daemon is not running.\n");
+  ring = mmap (NULL, sizeof (*ring), PROT_READ | (writable ? PROT_WRITE : 0),
+               MAP_SHARED, fd, 0);
+  if (ring == MAP_FAILED)
+    {
+      ring = NULL;
+      goto out;
+    }
 
-      xexecvp (v[0], v);
+  if (writable)
+    __atomic_compare_exchange_n (&ring->magic, &magic, STATS_MAGIC, false,
+                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n (&ring->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC)
+    {
+      munmap (ring, sizeof (*ring));
+      ring = NULL;
     }
 
-  status = wait_program_termination (pid);
+ out:
+  close (fd);
+  return ring;
+}
 
-  if (unlikely (EXITED_UNSUCCESSFULLY (status)))
-    die (EXIT_FAILURE, "Failed to stop Emacs daemon.\n");
+/* Append the latency of this invocation, counted from its start.  */
+static void
+record_stats (enum stats_kind kind)
+{
+  uint64_t i;
+  uint64_t now = monotonic_ns ();
+  struct stats_record *record;
+  struct stats_ring *ring = map_stats (true);
+
+  if (ring == NULL)
+    return;
+
+  i = __atomic_fetch_add (&ring->next, 1, __ATOMIC_RELAXED);
+  record = &ring->records[i % STATS_RECORDS];
+
+  __atomic_store_n (&record->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  record->kind = kind;
+  record->total = now - trace_start;
+  memset (record->phases, 0, sizeof (record->phases));
+  for (size_t j = 0; j < trace_phase_count; j++)
+    for (size_t k = 0; k < STATS_PHASES; k++)
+      if (streq (trace_phases[j].name, stats_phase_names[k]))
+        {
+          uint64_t end = trace_phases[j].end != 0 ? trace_phases[j].end : now;
+          record->phases[k] += end - trace_phases[j].start;
+          break;
+        }
+
+  __atomic_store_n (&record->sequence, i + 1, __ATOMIC_RELEASE);
+
+  munmap (ring, sizeof (*ring));
+}
+
+static int
+compare_uint64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Print the percentiles of N latencies in VALUES, which get sorted.  */
+static void print_percentiles (const char *name, uint64_t *values, size_t n) __nonnull ((1, 2));
+static void
+print_percentiles (const char *name, uint64_t *values, size_t n)
+{
+  static const unsigned int percents[] = { 50, 90, 99 };
+
+  qsort (values, n, sizeof (*values), compare_uint64);
+
+  printf ("%-14s %7zu", name, n);
+  for (size_t i = 0; i < sizeof (percents) / sizeof (*percents); i++)
+    {
+      /* Nearest rank.  */
+      size_t rank = (n * percents[i] + 99) / 100;
+      printf (" %11.3f", values[rank - 1] / 1e6);
+    }
+  printf (" %11.3f\n", values[n - 1] / 1e6);
 }
+
 static __noreturn void
-restart_daemon (int argc, char **argv)
+print_stats (void)
 {
-  pid_t pid;
-  int status;
+  struct stats_ring *ring = map_stats (false);
+  struct stats_record *records;
+  uint64_t *values;
+  size_t n = 0;
+
+  if (ring == NULL)
+    die (EXIT_SUCCESS, "No statistics recorded yet.\n");
 
-  pid = xfork ();
-  if (pid == 0)
+  /* Take a consistent snapshot, skipping records being written.  */
+  records = xmallocarray (STATS_RECORDS, sizeof (*records));
+  for (size_t i = 0; i < STATS_RECORDS; i++)
     {
-      /* Stop executing until we are allowed to start daemon.  */
-      xraise (SIGSTOP);
-      start_daemon (false, argc, argv);
+      uint64_t sequence = __atomic_load_n (&ring->records[i].sequence, __ATOMIC_ACQUIRE);
+
+      if (sequence == 0)
+        continue;
+      records[n] = ring->records[i];
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&ring->records[i].sequence, __ATOMIC_RELAXED) == sequence
+          && records[n].kind < STATS_KINDS)
+        n++;
     }
+  munmap (ring, sizeof (*ring));
 
-  stop_daemon (true);
+  values = xmallocarray (n + 1, sizeof (*values));
 
-  xkill (pid, SIGCONT); /* Allow starter to start doing his job.  */
-  status = wait_program_termination (pid);
+  printf ("%-14s %7s %11s %11s %11s %11s\n",
+          "(ms)", "COUNT", "P50", "P90", "P99", "MAX");
+  for (size_t kind = 0; kind < STATS_KINDS; kind++)
+    {
+      size_t m = 0;
+
+      for (size_t i = 0; i < n; i++)
+        if (records[i].kind == kind)
+          values[m++] = records[i].total;
+      if (m == 0)
+        continue;
+      print_percentiles (stats_kind_names[kind], values, m);
+
+      for (size_t phase = 0; phase < STATS_PHASES; phase++)
+        {
+          char name[32];
+
+          m = 0;
+          for (size_t i = 0; i < n; i++)
+            if (records[i].kind == kind && records[i].phases[phase] != 0)
+              values[m++] = records[i].phases[phase];
+          if (m == 0)
+            continue;
+          strcpy (name, "  ");
+          strcat (name, stats_phase_names[phase]);
+          print_percentiles (name, values, m);
+        }
+    }
 
-  if (unlikely (EXITED_UNSUCCESSFULLY (status)))
-    die (EXIT_FAILURE, "Failed to start Emacs daemon.\n");
+  free (values);
+  free (records);
 
   exit (EXIT_SUCCESS);
 }
 
-static __noreturn void
-usage (int status)
-{
-  fputs ("\
-Usage: tes [OPTIONS] FILE...\n\
-Tiny Emacs Manager.\n\
-Every FILE can be either just a FILENAME or [+LINE[:COLUMN]] FILENAME.\n\
-\n\
-The following OPTIONS are accepted:\n\
-  --help                  Print this usage information message.\n\
-  --version               Print version.\n\
-  --startd                Start the emacs daemon.\n\
-  --restartd              Restart the already runned emacs daemon.\n\
-  --stopd                 Stop the emacs daemon.\n\
-\n\
-All other options will be passed to emacsclient.\n\
-",
-         (status == EXIT_SUCCESS ? stdout : stderr));
+poison (malloc calloc realloc fork kill raise execvp waitpid);
+poison (chmod mkdir sprintf snprintf asprintf getuid geteuid);
 
-  exit (status);
+static int wait_program_termination (pid_t pid) __warn_unused_result;
+static int
+wait_program_termination (pid_t pid)
+{
+  int status;
+  do
+    xwaitpid (pid, &status, 0);
+  while (unlikely (!TERMINATED (status)));
+  return status;
 }
 
-static __noreturn void
-version (void)
+/* Return true and store the status of PID if it has already terminated.  */
+static bool program_terminated (pid_t pid, int *status) __nonnull ((2)) __warn_unused_result;
+static bool
+program_terminated (pid_t pid, int *status)
 {
-  puts ("Tiny Emacs Manager 1.0");
-  exit (EXIT_SUCCESS);
+  return xwaitpid (pid, status, WNOHANG) == pid && TERMINATED (*status);
 }
 
-int
-main (int argc, char **argv)
+poison (xwaitpid);
+
+static __noreturn void usage (int status);
+
+/* Return the root of the project FILE belongs to, the nearest directory
+   up from FILE that has .git in it, or NULL if there is none.  */
+static char *project_root (const char *file) __nonnull ((1)) __warn_unused_result;
+static char *
+project_root (const char *file)
 {
-  pid_t pid;
-  int i;
-  int status;
+  char *directory;
+  char *slash;
+  struct stat sb;
 
-  uid = xgeteuid ();
+  directory = realpath (file, NULL);
+  if (directory == NULL)
+    {
+      /* The file may be yet to be created, look at its directory.  */
+      char *copy = xmalloc (strlen (file) + 1);
+      strcpy (copy, file);
+      slash = strrchr (copy, '/');
+      if (slash == NULL)
+        strcpy (copy, ".");
+      else
+        slash[slash == copy] = '\0';
+      directory = realpath (copy, NULL);
+      free (copy);
+      if (directory == NULL)
+        return NULL;
+    }
+  else if (stat (directory, &sb) == 0 && !S_ISDIR (sb.st_mode))
+    *strrchr (directory, '/') = '\0';
 
-#define EMACS_SOCKET_DIRECTORY "/tmp/.emacs-sockets"
+  directory = xreallocarray (directory, strlen (directory) + strlen ("/.git") + 1, sizeof (char));
+  while (true)
+    {
+      size_t length = strlen (directory);
+
+      strcpy (directory + length, "/.git");
+      if (stat (directory, &sb) == 0)
+        {
+          directory[length] = '\0';
+          return directory;
+        }
+      directory[length] = '\0';
 
-  socket_name = xmalloc (strlen (EMACS_SOCKET_DIRECTORY)
-                         + 1
-                         + INT_STRLEN_BOUND (uid_t)
-                         + 1
-                         + strlen ("socket")
-                         + 1);
+      if (length <= 1)
+        break;
+      slash = strrchr (directory, '/');
+      slash[slash == directory] = '\0';
+    }
+
+  free (directory);
+  return NULL;
+}
 
-  strcpy (socket_name, EMACS_SOCKET_DIRECTORY);
-  xmkdir (socket_name, 00777);
-  xsprintf (socket_name + strlen (socket_name), "/%u", uid);
-  xmkdir (socket_name, 00700);
-  strcpy (socket_name + strlen (socket_name), "/socket");
+/* At most this many bytes of every FILE, and of all of them together,
+   are read ahead while the daemon is being connected to or started.  */
+#define PREFETCH_FILE_LIMIT (64 << 20)
+#define PREFETCH_TOTAL_LIMIT (256 << 20)
 
-  for (i = 1; i < argc; i++)
+/* Ask the kernel to start reading the FILEs in ARGV into the page cache,
+   so that the daemon does not block on cold I/O when visiting them.  The
+   reads are asynchronous and go on while we connect to the daemon.  */
+static void prefetch_files (int argc, char **argv) __nonnull ((2));
+static void
+prefetch_files (int argc, char **argv)
+{
+  off_t budget = PREFETCH_TOTAL_LIMIT;
+
+  for (int i = 1; i < argc; i++)
+    if (streq (argv[i], "-e") || streq (argv[i], "-eval") || streq (argv[i], "--eval"))
+      return;
+
+  for (int i = 1; i < argc && budget > 0; i++)
     {
-      char *arg = argv[i];
+      struct stat sb;
+      off_t length;
+      int fd;
 
-      if (unlikely (arg[0] != '-' || arg[1] != '-' || arg[2] == '\0'))
+      if (argv[i][0] == '-')
+        {
+          /* Skip the argument of -a EDITOR.  */
+          i += streq (argv[i], "-a");
+          continue;
+        }
+      if (argv[i][0] == '+')
         continue;
-      arg += 2;
 
-      if (streq (arg, "help"))
-        usage (EXIT_SUCCESS);
-      if (streq (arg, "version"))
-        version ();
-      if (streq (arg, "startd"))
-        start_daemon (false, argc - i, argv + i);
-      if (streq (arg, "restartd"))
-        restart_daemon (argc - i, argv + i);
-      if (streq (arg, "stopd"))
-        stop_daemon (false);
+      fd = open (argv[i], O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+
+      if (fstat (fd, &sb) == 0 && S_ISREG (sb.st_mode) && sb.st_size != 0)
+        {
+          length = sb.st_size < PREFETCH_FILE_LIMIT ? sb.st_size : PREFETCH_FILE_LIMIT;
+          if (length > budget)
+            length = budget;
+          if (posix_fadvise (fd, 0, length, POSIX_FADV_WILLNEED) == 0)
+            budget -= length;
+        }
+
+      close (fd);
     }
+}
 
-  if (unlikely (!socket_exists (socket_name)))
+/* Return the name of the daemon for the project of the first FILE in
+   ARGV, or NULL to use the default daemon.  The name is the base name of
+   the project root followed by a hash of its full name, so that it stays
+   short enough for a socket name.  */
+static char *project_daemon_name (int argc, char **argv) __nonnull ((2)) __warn_unused_result;
+static char *
+project_daemon_name (int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
     {
-      start_daemon (true, 0, NULL);
+      char *root;
+      char *base;
+      char *name;
+      uint32_t hash = 2166136261u;
 
-      if (unlikely (!socket_exists (socket_name)))
-        die (EXIT_FAILURE, "Can not find socket.\n");
-    }
+      if (argv[i][0] == '-')
+        {
+          /* Skip the argument of -a EDITOR.  */
+          i += streq (argv[i], "-a");
+          continue;
+        }
+      if (argv[i][0] == '+')
+        continue;
 
-  pid = xfork ();
-  if (pid == 0)
-    start_client (argc, argv);
+      root = project_root (argv[i]);
+      if (root == NULL)
+        return NULL;
 
-  free (socket_name);
+      /* FNV-1a.  */
+      for (const char *p = root; *p != '\0'; p++)
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
 
+      base = strrchr (root, '/') + 1;
+      if (strlen (base) > 32)
+        base[32] = '\0';
+      name = xmalloc (strlen (base) + 1 + 8 + 1);
+      xsprintf (name, "%s-%08" PRIx32, (*base != '\0' ? base : "root"), hash);
+      free (root);
+
+      return name;
+    }
+
+  return NULL;
+}
+
+static char *get_alternate_editor (void) __returns_nonnull __warn_unused_result;
+static char *
+get_alternate_editor (void)
+{
+  char *alternate_editor = getenv ("ALTERNATE_EDITOR");
+  return alternate_editor != NULL ? alternate_editor : (char *) "";
+}
+
+/* The Emacs server protocol, as spoken by emacsclient.  Every request is
+   a single line of space-separated commands whose arguments are quoted by
+   quote_argument.  The server answers with lines of the same form.  See
+   lisp/server.el in the Emacs sources for the other side.  */
+
+static int emacs_socket = -1;
+static bool suppress_output = false;
+static bool tty = false;
+
+/* How long to wait for the first reply of the server, in milliseconds,
+   before giving up on it.  Zero means to wait forever.  */
+static uint64_t response_timeout = 0;
+
+static char send_buffer[BUFSIZ];
+static size_t send_buffer_length = 0;
+
+static void make_address (struct sockaddr_un *address, const char *socket_name) __nonnull ((1, 2));
+static void
+make_address (struct sockaddr_un *address, const char *socket_name)
+{
+  if (unlikely (strlen (socket_name) >= sizeof (address->sun_path)))
+    edie (ENAMETOOLONG, "%s", socket_name);
+
+  memset (address, 0, sizeof (*address));
+  address->sun_family = AF_UNIX;
+  strcpy (address->sun_path, socket_name);
+}
+
+static int connect_to_emacs (const char *socket_name) __nonnull ((1)) __warn_unused_result;
+static int
+connect_to_emacs (const char *socket_name)
+{
+  int fd;
+  struct sockaddr_un server;
+
+  make_address (&server, socket_name);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (unlikely (fd < 0))
+    edie (errno, "socket()");
+
+  if (unlikely (connect (fd, (struct sockaddr *) &server, sizeof (server)) != 0))
+    {
+      int saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Bind a socket to SOCKET_NAME and listen on it.  The descriptor is
+   inherited across exec.  */
+static int listen_on (const char *socket_name) __nonnull ((1)) __warn_unused_result;
+static int
+listen_on (const char *socket_name)
+{
+  int fd;
+  struct sockaddr_un server;
+
+  make_address (&server, socket_name);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (unlikely (fd < 0))
+    edie (errno, "socket()");
+
+  if (unlikely (bind (fd, (struct sockaddr *) &server, sizeof (server)) != 0))
+    edie (errno, "bind(%s)", socket_name);
+  if (unlikely (listen (fd, SOMAXCONN) != 0))
+    edie (errno, "listen(%s)", socket_name);
+
+  return fd;
+}
+
+/* How long a probe may wait for the daemon to accept, in milliseconds.  */
+#define PROBE_TIMEOUT 50
+
+/* Check whether anybody listens on SOCKET_NAME with a non-blocking
+   connect().  Return 0 if so, otherwise the error connect() failed with:
+   ECONNREFUSED means that the socket is left by a dead daemon.  A full
+   backlog (EAGAIN) means that the daemon is alive but busy.  */
+static int probe_socket (const char *socket_name) __nonnull ((1)) __warn_unused_result;
+static int
+probe_socket (const char *socket_name)
+{
+  int fd;
+  int result = 0;
+  struct sockaddr_un server;
+
+  make_address (&server, socket_name);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (unlikely (fd < 0))
+    edie (errno, "socket()");
+
+  if (connect (fd, (struct sockaddr *) &server, sizeof (server)) != 0)
+    {
+      result = errno;
+      if (result == EAGAIN)
+        result = 0;
+      else if (result == EINPROGRESS)
+        {
+          struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+          socklen_t length = sizeof (result);
+
+          if (poll (&pfd, 1, PROBE_TIMEOUT) <= 0)
+            result = ETIMEDOUT;
+          else if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &result, &length) != 0)
+            result = errno;
+        }
+    }
+
+  close (fd);
+
+  return result;
+}
+
+static bool socket_exists (const char *socket_name) __nonnull ((1)) __warn_unused_result;
+static bool
+socket_exists (const char *socket_name)
+{
+  struct stat sb;
+
+  if (stat (socket_name, &sb) != 0)
+    {
+      if (errno == ENOENT)
+        return false;
+      else
+        edie (errno, "stat(%s)", socket_name);
+    }
+
+  if (unlikely (!S_ISSOCK (sb.st_mode)))
+    edie (ENOTSOCK, "%s", socket_name);
+
+  /* There is a socket in our directory,
+     but this socket is not owned by us.  */
+  if (unlikely (sb.st_uid != uid))
+    die (EXIT_FAILURE, "The socket does not belong to us.\n");
+
+  if (faccessat (AT_FDCWD, socket_name, X_OK, AT_EACCESS) != 0)
+    return false;
+
+  /* The daemon may have crashed or have been killed by the OOM killer
+     leaving its socket behind, see remove_stale_socket.  */
+  if (unlikely (probe_socket (socket_name) == ECONNREFUSED))
+    return false;
+
+  return true;
+}
+
+/* Remove the socket SOCKET_NAME left behind by a dead daemon, so that a
+   new daemon can be started in its place.  The startup lock must be
+   held, otherwise this could remove the socket of a daemon that
+   another invocation has just started.  */
+static void remove_stale_socket (const char *socket_name) __nonnull ((1));
+static void
+remove_stale_socket (const char *socket_name)
+{
+  if (probe_socket (socket_name) == ECONNREFUSED
+      && unlink (socket_name) != 0 && errno != ENOENT)
+    edie (errno, "unlink(%s)", socket_name);
+}
+
+static void
+flush_to_emacs (void)
+{
+  size_t offset = 0;
+
+  while (offset < send_buffer_length)
+    {
+      ssize_t n = send (emacs_socket, send_buffer + offset,
+                        send_buffer_length - offset, MSG_NOSIGNAL);
+      if (unlikely (n < 0))
+        {
+          if (errno == EINTR)
+            continue;
+          edie (errno, "send()");
+        }
+      offset += n;
+    }
+
+  send_buffer_length = 0;
+}
+
+static void
+send_char_to_emacs (char c)
+{
+  if (unlikely (send_buffer_length == sizeof (send_buffer)))
+    flush_to_emacs ();
+  send_buffer[send_buffer_length++] = c;
+}
+
+static void send_to_emacs (const char *data) __nonnull ((1));
+static void
+send_to_emacs (const char *data)
+{
+  while (*data != '\0')
+    send_char_to_emacs (*data++);
+}
+
+/* Send S quoted so that the server sees it as a single argument:
+   '&' becomes "&&", ' ' becomes "&_", '\n' becomes "&n" and a leading
+   '-' becomes "&-".  */
+static void quote_argument (const char *s) __nonnull ((1));
+static void
+quote_argument (const char *s)
+{
+  if (*s == '-')
+    {
+      send_to_emacs ("&-");
+      s++;
+    }
+
+  for (; *s != '\0'; s++)
+    switch (*s)
+      {
+      case ' ':
+        send_to_emacs ("&_");
+        break;
+      case '\n':
+        send_to_emacs ("&n");
+        break;
+      case '&':
+        send_to_emacs ("&&");
+        break;
+      default:
+        send_char_to_emacs (*s);
+        break;
+      }
+}
+
+/* Send COMMAND followed by its quoted ARGUMENT, if any.  */
+static void send_command (const char *command, const char *argument) __nonnull ((1));
+static void
+send_command (const char *command, const char *argument)
+{
+  send_to_emacs (command);
+  send_char_to_emacs (' ');
+  if (argument != NULL)
+    {
+      quote_argument (argument);
+      send_char_to_emacs (' ');
+    }
+}
+
+/* Undo quote_argument in place.  */
+static char *unquote_argument (char *s) __nonnull ((1)) __returns_nonnull;
+static char *
+unquote_argument (char *s)
+{
+  char *p = s;
+  char *q = s;
+
+  while (*p != '\0')
+    {
+      if (*p == '&')
+        {
+          p++;
+          if (*p == '_')
+            *p = ' ';
+          else if (*p == 'n')
+            *p = '\n';
+          else if (*p == '\0')
+            break;
+        }
+      *q++ = *p++;
+    }
+  *q = '\0';
+
+  return s;
+}
+
+/* Return the PID of the process on the other end of the socket FD.  */
+static pid_t peer_pid (int fd) __warn_unused_result;
+static pid_t
+peer_pid (int fd)
+{
+  struct ucred credentials;
+  socklen_t length = sizeof (credentials);
+
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0)
+    return 0;
+  return credentials.pid;
+}
+
+/* Connect to the daemon listening on SOCKET_NAME if it runs as us, and
+   remember its PID.  Return -1 otherwise.  */
+static int connect_to_own_daemon (const char *socket_name) __nonnull ((1)) __warn_unused_result;
+static int
+connect_to_own_daemon (const char *socket_name)
+{
+  struct ucred credentials;
+  socklen_t length = sizeof (credentials);
+  int fd = connect_to_emacs (socket_name);
+
+  if (fd < 0)
+    return -1;
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0
+      || credentials.uid != uid)
+    {
+      close (fd);
+      return -1;
+    }
+
+  emacs_pid = credentials.pid;
+  return fd;
+}
+
+/* Handle SIGNO delivered through the signalfd.  Return false if the
+   client has to give up.  */
+static bool
+handle_signal (int signo)
+{
+  switch (signo)
+    {
+    case SIGCONT:
+      if (tcgetpgrp (STDOUT_FILENO) == getpgrp ())
+        {
+          /* We are in the foreground.  */
+          send_to_emacs ("-resume \n");
+          flush_to_emacs ();
+        }
+      else if (tty)
+        /* We are in the background; cancel the continue.  */
+        xkill (getpid (), SIGSTOP);
+      break;
+
+    case SIGTSTP:
+      if (tty)
+        {
+          /* Let Emacs release the terminal, it will tell us to stop.  */
+          send_to_emacs ("-suspend \n");
+          flush_to_emacs ();
+        }
+      else
+        xkill (getpid (), SIGSTOP);
+      break;
+
+    case SIGWINCH:
+      if (emacs_pid > 0)
+        xkill (emacs_pid, SIGWINCH);
+      break;
+
+    case SIGINT:
+      /* Like emacsclient, never pass it on: a daemon without a frame
+         on its controlling terminal takes SIGINT for kill-emacs.  */
+      return false;
+    }
+
+  return true;
+}
+
+/* Where the -print replies go when not to stdout, see eval_to_string.  */
+static FILE *reply_output = NULL;
+
+/* Handle a single reply LINE from the server.  Return false if it
+   reports an error.  */
+static bool handle_reply (char *line, bool *need_newline) __nonnull ((1, 2));
+static bool
+handle_reply (char *line, bool *need_newline)
+{
+  char *s;
+
+#define REPLY_IS(prefix) \
+  (strneq (line, prefix, strlen (prefix)) && (s = line + strlen (prefix)))
+
+  if (REPLY_IS ("-emacs-pid "))
+    emacs_pid = strtoumax (s, NULL, 10);
+  else if (REPLY_IS ("-print ") || REPLY_IS ("-print-nonl "))
+    {
+      if (!suppress_output)
+        {
+          bool continuation = line[strlen ("-print")] == '-';
+          s = unquote_argument (s);
+          fprintf ((reply_output != NULL ? reply_output : stdout), "%s%s",
+                   (*need_newline && !continuation ? "\n" : ""), s);
+          if (*s != '\0')
+            *need_newline = s[strlen (s) - 1] != '\n';
+        }
+    }
+  else if (REPLY_IS ("-error "))
+    {
+      s = unquote_argument (s);
+      fflush (stdout);
+      fprintf (stderr, "%s*ERROR*: %s", (*need_newline ? "\n" : ""), s);
+      if (*s != '\0')
+        *need_newline = s[strlen (s) - 1] != '\n';
+      return false;
+    }
+  else if (REPLY_IS ("-suspend "))
+    {
+      *need_newline = false;
+      xkill (0, SIGSTOP);
+    }
+  else if (REPLY_IS ("-window-system-unsupported "))
+    {
+      if (!tty)
+        {
+          fflush (stdout);
+          fprintf (stderr, "%s*ERROR*: Emacs can not open graphical frames\n",
+                   (*need_newline ? "\n" : ""));
+          *need_newline = false;
+          return false;
+        }
+    }
+  else
+    {
+      fflush (stdout);
+      fprintf (stderr, "%s*ERROR*: Unknown message: %s\n",
+               (*need_newline ? "\n" : ""), line);
+      *need_newline = false;
+    }
+
+#undef REPLY_IS
+
+  return true;
+}
+
+/* Move what is available on standard input to the end of STDIN_COPY,
+   waiting up to TIMEOUT milliseconds for it to become available.
+   Return false at the end of file.  */
+static bool copy_stdin (int timeout);
+static bool
+copy_stdin (int timeout)
+{
+  struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+
+  while (true)
+    {
+      ssize_t n;
+      int ready = poll (&pfd, 1, timeout);
+
+      if (ready < 0 && errno == EINTR)
+        continue;
+      if (unlikely (ready < 0))
+        edie (errno, "poll()");
+      if (ready == 0)
+        return true;
+
+      n = splice (STDIN_FILENO, NULL, stdin_copy, &stdin_copy_length,
+                  1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && errno == EINVAL)
+        {
+          /* Standard input is not a pipe.  */
+          char buffer[BUFSIZ];
+
+          n = read (STDIN_FILENO, buffer, sizeof (buffer));
+          if (n > 0 && unlikely (pwrite (stdin_copy, buffer, n, stdin_copy_length) != n))
+            edie (errno, "write()");
+          if (n > 0)
+            stdin_copy_length += n;
+        }
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      if (unlikely (n < 0))
+        edie (errno, "stdin");
+      if (n == 0)
+        return false;
+    }
+}
+
+/* The kind of client invocation whose latency is recorded once the
+   server has done the work, and the phase that lasts until then.  The
+   server sends -emacs-pid before it visits any file or makes a frame,
+   so that is the first reply after -emacs-pid, or the end of the
+   connection, as for --no-wait.  */
+static enum stats_kind client_kind = STATS_WARM;
+static int reply_phase = -1;
+
+static void
+handle_first_reply (void)
+{
+  if (reply_phase < 0)
+    return;
+
+  trace_end (reply_phase);
+  reply_phase = -1;
+  record_stats (client_kind);
+
+  /* The session phase lasts until the client exits.  */
+  trace_begin ("session");
+}
+
+/* Status of receive_from_emacs when the server did not answer in time.  */
+#define NO_RESPONSE (-1)
+
+/* Read and handle replies until the server closes the connection.  The
+   socket, signals (through a signalfd) and the daemon process (through a
+   pidfd) are watched with epoll, so that a daemon which does not answer
+   within response_timeout or dies without closing our connection does
+   not hang the client.  Return the exit status the client should finish
+   with, or NO_RESPONSE.  */
+static int
+receive_from_emacs (void)
+{
+  enum { SOCKET, SIGNALS, DAEMON, STREAM };
+
+  /* Replies rarely outgrow it, and the warm path does not allocate.  */
+  static char initial_buffer[BUFSIZ];
+  size_t capacity = sizeof (initial_buffer);
+  size_t length = 0;
+  char *buffer = initial_buffer;
+  bool need_newline = false;
+  bool replied = false;
+  bool done = false;
+  bool daemon_exited = false;
+  int status = EXIT_SUCCESS;
+  uint64_t deadline = 0;
+  int fds[4];
+  int epoll_fd;
+  sigset_t signals;
+  sigset_t saved_signals;
+  struct sigaction sa;
+
+  if (emacs_pid == 0)
+    emacs_pid = peer_pid (emacs_socket);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGTTOU, &sa, NULL);
+
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGCONT);
+  sigaddset (&signals, SIGTSTP);
+  sigaddset (&signals, SIGWINCH);
+  sigaddset (&signals, SIGINT);
+  sigprocmask (SIG_BLOCK, &signals, &saved_signals);
+
+  epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (unlikely (epoll_fd < 0))
+    edie (errno, "epoll_create1()");
+
+  fds[SOCKET] = emacs_socket;
+  fds[SIGNALS] = signalfd (-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (unlikely (fds[SIGNALS] < 0))
+    edie (errno, "signalfd()");
+  fds[DAEMON] = emacs_pid > 0 ? pidfd_of (emacs_pid) : -1;
+  fds[STREAM] = stdin_streaming ? STDIN_FILENO : -1;
+
+  for (int i = SOCKET; i <= STREAM; i++)
+    if (fds[i] >= 0)
+      {
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+        if (unlikely (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fds[i], &event) != 0))
+          edie (errno, "epoll_ctl()");
+      }
+
+  if (response_timeout != 0)
+    deadline = monotonic_ns () + response_timeout * 1000000;
+
+  while (!done)
+    {
+      struct epoll_event events[4];
+      bool ready[4] = { false, false, false, false };
+      int timeout = -1;
+      int n;
+
+      if (daemon_exited)
+        timeout = 0;
+      else if (!replied && deadline != 0)
+        {
+          uint64_t now = monotonic_ns ();
+          timeout = now < deadline ? (deadline - now + 999999) / 1000000 : 0;
+        }
+
+      n = epoll_wait (epoll_fd, events, 4, timeout);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          edie (errno, "epoll_wait()");
+        }
+      if (n == 0 && daemon_exited)
+        {
+          fflush (stdout);
+          fputs ("Emacs daemon exited.\n", stderr);
+          status = EXIT_FAILURE;
+          break;
+        }
+      if (n == 0)
+        {
+          status = NO_RESPONSE;
+          break;
+        }
+
+      for (int i = 0; i < n; i++)
+        ready[events[i].data.u32] = true;
+
+      /* Replies go first, the daemon might have said its last words.  */
+      if (ready[SOCKET])
+        {
+          ssize_t received;
+          char *start;
+          char *end;
+
+          if (length == capacity && buffer == initial_buffer)
+            buffer = memcpy (xmallocarray (capacity *= 2, sizeof (*buffer)),
+                             initial_buffer, length);
+          else if (length == capacity)
+            buffer = xreallocarray (buffer, capacity *= 2, sizeof (*buffer));
+
+          received = recv (emacs_socket, buffer + length, capacity - length, MSG_DONTWAIT);
+          if (received < 0)
+            {
+              if (errno != EINTR && errno != EAGAIN)
+                edie (errno, "recv()");
+              received = 0;
+            }
+          else if (received == 0)
+            {
+              done = true;
+              handle_first_reply ();
+            }
+          length += received;
+
+          start = buffer;
+          while ((end = memchr (start, '\n', buffer + length - start)) != NULL)
+            {
+              *end = '\0';
+              replied = true;
+              if (!strprefix (start, "-emacs-pid "))
+                handle_first_reply ();
+              if (!handle_reply (start, &need_newline))
+                status = EXIT_FAILURE;
+              start = end + 1;
+            }
+
+          length -= start - buffer;
+          memmove (buffer, start, length);
+        }
+
+      if (ready[SIGNALS])
+        {
+          struct signalfd_siginfo info;
+
+          while (read (fds[SIGNALS], &info, sizeof (info)) == sizeof (info))
+            if (!handle_signal (info.ssi_signo))
+              {
+                status = 128 + info.ssi_signo;
+                done = true;
+              }
+        }
+
+      /* Keep the copy of standard input growing for the daemon to
+         revert its buffer from.  */
+      if (ready[STREAM] && !(stdin_streaming = copy_stdin (0)))
+        epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fds[STREAM], NULL);
+
+      /* Read what the daemon has said before it exited, but somebody
+         else may still hold our connection open, e.g. a child process
+         of the daemon, so do not wait for the end of file.  */
+      if (ready[DAEMON])
+        {
+          epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fds[DAEMON], NULL);
+          daemon_exited = true;
+        }
+    }
+
+  close (epoll_fd);
+  close (fds[SIGNALS]);
+  if (fds[DAEMON] >= 0)
+    close (fds[DAEMON]);
+  sigprocmask (SIG_SETMASK, &saved_signals, NULL);
+
+  if (need_newline)
+    fputc ('\n', (reply_output != NULL ? reply_output : stdout));
+  fflush (stdout);
+  if (buffer != initial_buffer)
+    free (buffer);
+
+  return status;
+}
+
+/* Return the working directory, asked for only once.  Only a directory
+   deeper than PATH_MAX is allocated.  */
+static const char *current_directory (void) __returns_nonnull;
+static const char *
+current_directory (void)
+{
+  static char buffer[PATH_MAX];
+  static char *cwd = NULL;
+
+  if (cwd == NULL && (cwd = getcwd (buffer, sizeof (buffer))) == NULL
+      && (errno != ERANGE || (cwd = getcwd (NULL, 0)) == NULL))
+    edie (errno, "getcwd()");
+  return cwd;
+}
+
+static void
+send_environment_and_directory (void)
+{
+  if (tty)
+    for (char **e = environ; *e != NULL; e++)
+      send_command ("-env", *e);
+
+  send_to_emacs ("-dir ");
+  quote_argument (current_directory ());
+  send_to_emacs ("/ ");
+}
+
+/* Evaluate EXPRESSION in the daemon connected to FD, which is closed
+   afterwards.  Return the exit status emacsclient --eval would have.  */
+static int eval_on_connection (int fd, const char *expression, bool print) __nonnull ((2));
+static int
+eval_on_connection (int fd, const char *expression, bool print)
+{
+  int status;
+  int phase = trace_begin ("eval");
+
+  emacs_socket = fd;
+  suppress_output = !print;
+  tty = false;
+
+  send_environment_and_directory ();
+  send_command ("-current-frame", NULL);
+  send_command ("-eval", expression);
+  send_to_emacs ("\n");
+  flush_to_emacs ();
+
+  status = receive_from_emacs ();
+  if (unlikely (status == NO_RESPONSE))
+    {
+      error (0, 0, "Emacs daemon did not respond within %" PRIu64 " ms "
+             "(see --response-timeout)", response_timeout);
+      status = EXIT_FAILURE;
+    }
+
+  close (emacs_socket);
+  emacs_socket = -1;
+  emacs_pid = 0;
+  trace_end (phase);
+
+  return status;
+}
+
+/* Evaluate EXPRESSION in the daemon listening on NAME.  */
+static int eval_in_daemon (const char *name, const char *expression, bool print) __nonnull ((1, 2));
+static int
+eval_in_daemon (const char *name, const char *expression, bool print)
+{
+  int fd = connect_to_emacs (name);
+  if (unlikely (fd < 0))
+    return EXIT_FAILURE;
+  return eval_on_connection (fd, expression, print);
+}
+
+/* Evaluate EXPRESSION in the daemon listening on NAME and return what
+   it printed, or NULL if that failed.  */
+static char *eval_to_string (const char *name, const char *expression) __nonnull ((1, 2)) __warn_unused_result;
+static char *
+eval_to_string (const char *name, const char *expression)
+{
+  char *output = NULL;
+  size_t size = 0;
+  int status;
+
+  reply_output = open_memstream (&output, &size);
+  if (unlikely (reply_output == NULL))
+    edie (errno, "open_memstream()");
+  status = eval_in_daemon (name, expression, true);
+  fclose (reply_output);
+  reply_output = NULL;
+
+  if (status != EXIT_SUCCESS)
+    {
+      free (output);
+      return NULL;
+    }
+  return output;
+}
+
+/* Return S as a newly allocated ELisp string literal.  */
+static char *lisp_string (const char *s) __nonnull ((1)) __returns_nonnull __warn_unused_result;
+static char *
+lisp_string (const char *s)
+{
+  char *literal = xmallocarray (2 * strlen (s) + 3, sizeof (char));
+  char *p = literal;
+
+  *p++ = '"';
+  for (; *s != '\0'; s++)
+    {
+      if (*s == '"' || *s == '\\')
+        *p++ = '\\';
+      *p++ = *s;
+    }
+  *p++ = '"';
+  *p = '\0';
+
+  return literal;
+}
+
+static bool daemon_accepts_connections (const char *name) __nonnull ((1)) __warn_unused_result;
+static bool
+daemon_accepts_connections (const char *name)
+{
+  return probe_socket (name) == 0;
+}
+
+/* Wait until the daemon started as PID accepts connections on NAME.
+   Emacs binds its socket only once the init file has been loaded, so
+   watch the socket directory with inotify and retry connect() with
+   exponential backoff in case inotify is unavailable or the socket is
+   bound but not listening yet.  The pidfd of PID wakes us up as soon as
+   the foreground Emacs exits.  */
+static void wait_for_daemon (const char *name, pid_t pid) __nonnull ((1));
+static void
+wait_for_daemon (const char *name, pid_t pid)
+{
+  int status;
+  int backoff = 1;
+  bool exited = false;
+  uint64_t start = monotonic_ns ();
+  struct pollfd fds[2];
+
+  memset (fds, 0, sizeof (fds));
+
+  fds[0].fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  fds[0].events = POLLIN;
+  if (fds[0].fd >= 0
+      && inotify_add_watch (fds[0].fd, socket_directory, IN_CREATE | IN_MOVED_TO) < 0)
+    {
+      close (fds[0].fd);
+      fds[0].fd = -1;
+    }
+
+  fds[1].fd = pidfd_of (pid);
+  fds[1].events = POLLIN;
+
+  while (!daemon_accepts_connections (name))
+    {
+      uint64_t elapsed;
+      int wait;
+      int n;
+
+      if (exited)
+        die (EXIT_FAILURE, "Can not find socket.\n");
+
+      /* The foreground Emacs exits once the daemon is ready, so check
+         the socket one last time after that.  Without a pidfd we have
+         to look every time.  */
+      if ((fds[1].fd < 0 || (fds[1].revents & POLLIN))
+          && program_terminated (pid, &status))
+        {
+          if (unlikely (EXITED_UNSUCCESSFULLY (status)))
+            die (EXIT_FAILURE, "Failed to start daemon.\n");
+          exited = true;
+          continue;
+        }
+
+      elapsed = (monotonic_ns () - start) / 1000000;
+      if (unlikely (daemon_start_timeout != 0 && elapsed >= daemon_start_timeout))
+        error (EXIT_FAILURE, 0,
+               "Emacs daemon did not accept connections on %s within %" PRIu64 " ms "
+               "(see --start-timeout)",
+               name, daemon_start_timeout);
+
+      wait = backoff;
+      if (daemon_start_timeout != 0 && daemon_start_timeout - elapsed < (uint64_t) wait)
+        wait = daemon_start_timeout - elapsed;
+
+      /* poll() ignores negative descriptors.  */
+      n = poll (fds, 2, wait);
+      if (n > 0 && (fds[0].revents & POLLIN))
+        {
+          char events[sizeof (struct inotify_event) + NAME_MAX + 1];
+          while (read (fds[0].fd, events, sizeof (events)) > 0)
+            continue;
+        }
+      else if (n == 0 && backoff < 100)
+        backoff *= 2;
+    }
+
+  for (size_t i = 0; i < 2; i++)
+    if (fds[i].fd >= 0)
+      close (fds[i].fd);
+}
+
+/* Portable dump images.  e --dump loads the user's init files into a
+   batch Emacs and dumps it to emacs-KEY.pdmp in the socket directory,
+   and daemons are started from that image.  KEY hashes the names, sizes
+   and modification times of the Emacs binary and of the init files, so
+   an image older than any of them is never used.  */
+
+#define DUMP_PREFIX "emacs-"
+#define DUMP_SUFFIX ".pdmp"
+
+/* Init files and package directories relative to the home directory.  */
+static const char *const init_files[] =
+  {
+    ".emacs",
+    ".emacs.el",
+    ".emacs.d/early-init.el",
+    ".emacs.d/init.el",
+    ".emacs.d/elpa",
+    ".config/emacs/early-init.el",
+    ".config/emacs/init.el",
+    ".config/emacs/elpa",
+  };
+
+static const char *home_directory (void) __returns_nonnull;
+static const char *
+home_directory (void)
+{
+  const char *home = getenv ("HOME");
+
+  /* getpwuid would need the shared NSS modules of a static binary.  */
+  if (unlikely (home == NULL || *home == '\0'))
+    die (EXIT_FAILURE, "Please set the HOME variable to your home directory.\n");
+
+  return home;
+}
+
+/* Return FILE in the home directory, or NULL if it does not exist.  */
+static char *home_file (const char *file) __nonnull ((1)) __warn_unused_result;
+static char *
+home_file (const char *file)
+{
+  const char *home = home_directory ();
+  char *name = xmalloc (strlen (home) + 1 + strlen (file) + 1);
+
+  xsprintf (name, "%s/%s", home, file);
+  if (access (name, F_OK) == 0)
+    return name;
+
+  free (name);
+  return NULL;
+}
+
+/* Return the file name of PROGRAM found in PATH, or NULL.  */
+static char *find_program (const char *program) __nonnull ((1)) __warn_unused_result;
+static char *
+find_program (const char *program)
+{
+  const char *path = getenv ("PATH");
+
+  if (path == NULL)
+    path = _PATH_DEFPATH;
+
+  while (true)
+    {
+      size_t n = strcspn (path, ":");
+      char *file = xmalloc (n + 1 + 1 + strlen (program) + 1);
+
+      xsprintf (file, "%.*s/%s", (int) (n != 0 ? n : 1), (n != 0 ? path : "."), program);
+      if (access (file, X_OK) == 0)
+        return file;
+      free (file);
+
+      if (path[n] == '\0')
+        return NULL;
+      path += n + 1;
+    }
+}
+
+/* FNV-1a.  */
+static uint64_t hash_bytes (uint64_t hash, const void *data, size_t size) __nonnull ((2));
+static uint64_t
+hash_bytes (uint64_t hash, const void *data, size_t size)
+{
+  const unsigned char *p = data;
+
+  while (size-- != 0)
+    hash = (hash ^ *p++) * 1099511628211u;
+  return hash;
+}
+
+static uint64_t hash_file (uint64_t hash, const char *file) __nonnull ((2));
+static uint64_t
+hash_file (uint64_t hash, const char *file)
+{
+  struct stat sb;
+
+  hash = hash_bytes (hash, file, strlen (file) + 1);
+  if (stat (file, &sb) == 0)
+    {
+      uint64_t fields[] =
+        {
+          sb.st_dev, sb.st_ino, sb.st_size,
+          sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec
+        };
+      hash = hash_bytes (hash, fields, sizeof (fields));
+    }
+
+  return hash;
+}
+
+/* Return the name of the dump image matching the current Emacs binary
+   and init files, or NULL if there is no emacs in PATH.  */
+static char *dump_image_name (void) __warn_unused_result;
+static char *
+dump_image_name (void)
+{
+  char name[sizeof (DUMP_PREFIX) + 16 + sizeof (DUMP_SUFFIX)];
+  uint64_t key = 14695981039346656037u;
+  const char *home = home_directory ();
+  char *emacs = find_program ("emacs");
+
+  if (emacs == NULL)
+    return NULL;
+  key = hash_file (key, emacs);
+  free (emacs);
+
+  for (size_t i = 0; i < sizeof (init_files) / sizeof (*init_files); i++)
+    {
+      char *file = xmalloc (strlen (home) + 1 + strlen (init_files[i]) + 1);
+      xsprintf (file, "%s/%s", home, init_files[i]);
+      key = hash_file (key, file);
+      free (file);
+    }
+
+  xsprintf (name, DUMP_PREFIX "%016" PRIx64 DUMP_SUFFIX, key);
+  return socket_directory_file (name);
+}
+
+/* Return whether there are dump images other than KEEP, removing them
+   if REMOVE.  */
+static bool other_dump_images (const char *keep, bool remove);
+static bool
+other_dump_images (const char *keep, bool remove)
+{
+  DIR *directory = opendir (socket_directory);
+  struct dirent *entry;
+  bool found = false;
+
+  if (directory == NULL)
+    return false;
+
+  while ((entry = readdir (directory)) != NULL)
+    {
+      size_t length = strlen (entry->d_name);
+      char *name;
+
+      if (!strprefix (entry->d_name, DUMP_PREFIX)
+          || length < strlen (DUMP_SUFFIX)
+          || !streq (entry->d_name + length - strlen (DUMP_SUFFIX), DUMP_SUFFIX))
+        continue;
+
+      name = socket_directory_file (entry->d_name);
+      if (keep == NULL || !streq (name, keep))
+        {
+          found = true;
+          if (remove)
+            unlink (name);
+        }
+      free (name);
+    }
+
+  closedir (directory);
+  return found;
+}
+
+/* Rebuild the dump image with e --dump in the background, so that the
+   next daemon starts from an image matching the init files again.  */
+static void
+rebuild_dump_image (void)
+{
+  char *v[] = { "tem", "--dump", NULL };
+  int null = open (_PATH_DEVNULL, O_WRONLY | O_CLOEXEC);
+  int phase = trace_begin ("dump");
+
+  /* Nobody waits for it, its log tells whether it failed.  */
+  trace_pid (phase, xspawnp ("/proc/self/exe", v, true, null));
+  trace_end (phase);
+  if (null >= 0)
+    close (null);
+}
+
+/* Return the --dump-file argument for a new daemon, or NULL if no image
+   is to be used.  A stale image is never used, but rebuilt instead.  */
+static const char *
+dump_file_argument (void)
+{
+  static bool looked_up = false;
+  static char *argument = NULL;
+  char *image;
+
+  if (looked_up)
+    return argument;
+  looked_up = true;
+
+  image = dump_image_name ();
+  if (image == NULL)
+    return NULL;
+
+  if (access (image, R_OK) == 0)
+    {
+      argument = xmalloc (strlen ("--dump-file=") + strlen (image) + 1);
+      xsprintf (argument, "--dump-file=%s", image);
+    }
+  else if (other_dump_images (image, false))
+    rebuild_dump_image ();
+
+  free (image);
+  return argument;
+}
+
+/* Dump an Emacs with the user's init files loaded, passing the rest of
+   ARGV to it.  Its output goes to dump.log in the socket directory.  */
+static __noreturn void dump_emacs (int argc, char **argv) __nonnull ((2));
+static __noreturn void
+dump_emacs (int argc, char **argv)
+{
+  static const char *const init_candidates[] = { ".emacs", ".emacs.el", NULL };
+  char *image = dump_image_name ();
+  char *temporary;
+  char *literal;
+  char *expression;
+  char *lock_name;
+  char *log_name;
+  char *early_init;
+  char *init;
+  const char *emacs_directory;
+  char *emacs_directory_file;
+  char **v;
+  int c = 0;
+  int lock;
+  int log;
+  int status;
+  pid_t pid;
+
+  if (unlikely (image == NULL))
+    die (EXIT_FAILURE, "Could not find emacs in PATH.\n");
+
+  lock_name = socket_directory_file ("dump.lock");
+  lock = open (lock_name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (unlikely (lock < 0))
+    edie (errno, "open(%s)", lock_name);
+  if (unlikely (flock (lock, LOCK_EX | LOCK_NB) != 0))
+    {
+      if (errno == EWOULDBLOCK)
+        die (EXIT_FAILURE, "Emacs is already being dumped.\n");
+      edie (errno, "flock(%s)", lock_name);
+    }
+  free (lock_name);
+
+  /* Load the init files the way Emacs itself finds them.  */
+  emacs_directory = ".emacs.d";
+  emacs_directory_file = home_file (emacs_directory);
+  if (emacs_directory_file == NULL)
+    emacs_directory = ".config/emacs";
+  free (emacs_directory_file);
+
+  emacs_directory_file = xmalloc (strlen (emacs_directory) + strlen ("/early-init.el") + 1);
+  xsprintf (emacs_directory_file, "%s/early-init.el", emacs_directory);
+  early_init = home_file (emacs_directory_file);
+  init = NULL;
+  for (size_t i = 0; init == NULL && init_candidates[i] != NULL; i++)
+    init = home_file (init_candidates[i]);
+  if (init == NULL)
+    {
+      xsprintf (emacs_directory_file, "%s/init.el", emacs_directory);
+      init = home_file (emacs_directory_file);
+    }
+  free (emacs_directory_file);
+
+  temporary = xmalloc (strlen (image) + 1 + INT_STRLEN_BOUND (pid_t) + 1);
+  xsprintf (temporary, "%s.%d", image, getpid ());
+  literal = lisp_string (temporary);
+  expression = xmalloc (strlen ("(dump-emacs-portable )") + strlen (literal) + 1);
+  xsprintf (expression, "(dump-emacs-portable %s)", literal);
+  free (literal);
+
+  v = xmallocarray (argc + 10, sizeof (*v));
+  v[c++] = "emacs";
+  v[c++] = "--batch";
+  /* Packages are activated between the init files as Emacs does, after
+     early-init.el has had its say about which and where they are.  */
+  if (early_init != NULL)
+    {
+      v[c++] = "--load";
+      v[c++] = early_init;
+    }
+  v[c++] = "--eval";
+  v[c++] = "(progn (require 'package) (when package-enable-at-startup (package-activate-all)))";
+  if (init != NULL)
+    {
+      v[c++] = "--load";
+      v[c++] = init;
+    }
+  for (int i = 1; i < argc; i++)
+    v[c++] = argv[i];
+  v[c++] = "--eval";
+  v[c++] = expression;
+  v[c] = NULL;
+
+  log_name = socket_directory_file ("dump.log");
+  log = open (log_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (unlikely (log < 0))
+    edie (errno, "open(%s)", log_name);
+
+  pid = xspawnp (v[0], v, false, log);
   status = wait_program_termination (pid);
-  return EXITED_SUCCESSFULLY (status) ? EXIT_SUCCESS : EXIT_FAILURE;
+  close (log);
+
+  if (unlikely (!EXITED_SUCCESSFULLY (status) || access (temporary, R_OK) != 0))
+    {
+      unlink (temporary);
+      error (EXIT_FAILURE, 0, "Dumping Emacs failed, see %s", log_name);
+    }
+
+  if (unlikely (rename (temporary, image) != 0))
+    edie (errno, "rename(%s, %s)", temporary, image);
+  other_dump_images (image, true);
+
+  exit (EXIT_SUCCESS);
+}
+
+/* Precompilation.  e --warm byte-compiles the Lisp files of the user's
+   packages whose .elc is missing or older than the source, or whose
+   .eln is missing when Emacs compiles natively, and compiles them
+   natively as well when Emacs supports that, in a pool of batch
+   Emacs workers.  Otherwise the daemon would compile them lazily on its
+   only thread when it is started after a package update.  */
+
+/* Directories relative to the home directory searched for Lisp files.  */
+static const char *const lisp_directories[] =
+  {
+    ".emacs.d/elpa",
+    ".emacs.d/lisp",
+    ".config/emacs/elpa",
+    ".config/emacs/lisp",
+  };
+
+/* The number of workers, zero unless --warm was given.  */
+static long warm_jobs = 0;
+
+/* How many files a worker is given at most, so that the workers finish
+   at about the same time while the start of Emacs is amortized.  */
+#define WARM_MAX_CHUNK 32
+
+struct file_list
+{
+  char **files;
+  size_t count;
+  size_t capacity;
+};
+
+static void add_file (struct file_list *list, char *file) __nonnull ((1, 2));
+static void
+add_file (struct file_list *list, char *file)
+{
+  if (list->count == list->capacity)
+    list->files = xreallocarray (list->files,
+                                 (list->capacity = 2 * list->capacity + 16),
+                                 sizeof (*list->files));
+  list->files[list->count++] = file;
+}
+
+enum lisp_file_state
+{
+  LISP_FILE_SKIPPED,
+  LISP_FILE_STALE,
+  LISP_FILE_COMPILED
+};
+
+/* Return LISP_FILE_STALE if FILE, a .el file, is to be compiled: its
+   .elc is missing or older than it and it does not forbid compilation,
+   and LISP_FILE_COMPILED if its .elc is up to date.  */
+static enum lisp_file_state lisp_file_state (const char *file) __nonnull ((1)) __warn_unused_result;
+static enum lisp_file_state
+lisp_file_state (const char *file)
+{
+  char *elc;
+  char line[256];
+  struct stat el_sb;
+  struct stat elc_sb;
+  bool compiled;
+  ssize_t n;
+  int fd;
+
+  if (stat (file, &el_sb) != 0)
+    return LISP_FILE_SKIPPED;
+  elc = xmalloc (strlen (file) + 2);
+  xsprintf (elc, "%sc", file);
+  compiled = (stat (elc, &elc_sb) == 0
+              && (elc_sb.st_mtim.tv_sec > el_sb.st_mtim.tv_sec
+                  || (elc_sb.st_mtim.tv_sec == el_sb.st_mtim.tv_sec
+                      && elc_sb.st_mtim.tv_nsec >= el_sb.st_mtim.tv_nsec)));
+  free (elc);
+  if (compiled)
+    return LISP_FILE_COMPILED;
+
+  /* Without an .elc the file may just say no-byte-compile on its first
+     line, as autoloads and package descriptions do.  */
+  fd = open (file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return LISP_FILE_SKIPPED;
+  n = read (fd, line, sizeof (line) - 1);
+  close (fd);
+  if (n < 0)
+    return LISP_FILE_SKIPPED;
+  line[n] = '\0';
+  line[strcspn (line, "\n")] = '\0';
+
+  return strstr (line, "no-byte-compile: t") == NULL ? LISP_FILE_STALE : LISP_FILE_SKIPPED;
+}
+
+/* Add the stale Lisp files under DIRECTORY to STALE, and those that are
+   byte-compiled already to COMPILED.  */
+static void find_stale_lisp_files (const char *directory, struct file_list *stale, struct file_list *compiled) __nonnull ((1, 2, 3));
+static void
+find_stale_lisp_files (const char *directory, struct file_list *stale, struct file_list *compiled)
+{
+  DIR *stream = opendir (directory);
+  struct dirent *entry;
+
+  if (stream == NULL)
+    return;
+
+  while ((entry = readdir (stream)) != NULL)
+    {
+      size_t length = strlen (entry->d_name);
+      unsigned char type = entry->d_type;
+      char *file;
+
+      if (entry->d_name[0] == '.')
+        continue;
+
+      /* Not every file system fills in d_type.  */
+      if (type == DT_UNKNOWN)
+        {
+          struct stat sb;
+
+          if (fstatat (dirfd (stream), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+          type = (S_ISDIR (sb.st_mode) ? DT_DIR
+                  : S_ISREG (sb.st_mode) ? DT_REG
+                  : S_ISLNK (sb.st_mode) ? DT_LNK
+                  : DT_UNKNOWN);
+        }
+
+      file = xmalloc (strlen (directory) + 1 + length + 1);
+      xsprintf (file, "%s/%s", directory, entry->d_name);
+
+      if (type == DT_DIR)
+        find_stale_lisp_files (file, stale, compiled);
+      else if ((type == DT_REG || type == DT_LNK)
+               && length > 3 && streq (entry->d_name + length - 3, ".el"))
+        switch (lisp_file_state (file))
+          {
+          case LISP_FILE_STALE:
+            add_file (stale, file);
+            continue;
+          case LISP_FILE_COMPILED:
+            add_file (compiled, file);
+            continue;
+          case LISP_FILE_SKIPPED:
+            break;
+          }
+
+      free (file);
+    }
+
+  closedir (stream);
+}
+
+/* At most this many files are checked by one batch Emacs, to keep its
+   command line short.  */
+#define NATIVE_CHECK_CHUNK 1024
+
+/* Move the files in COMPILED that have no up-to-date .eln in
+   native-comp-eln-load-path to STALE when Emacs can compile natively,
+   and free the others.  Byte compilation at package installation does
+   not compile natively, the daemon would do so lazily.  */
+static void find_stale_native_files (struct file_list *compiled, struct file_list *stale) __nonnull ((1, 2));
+static void
+find_stale_native_files (struct file_list *compiled, struct file_list *stale)
+{
+  /* The name of an .eln has a hash of the contents of its source, so
+     one that exists is up to date.  */
+  static const char expression[] =
+    "(progn"
+    " (when (and (fboundp 'native-comp-available-p) (native-comp-available-p))"
+    " (dolist (f command-line-args-left)"
+    " (unless (condition-case nil"
+    " (let (found)"
+    " (dolist (d native-comp-eln-load-path found)"
+    " (when (file-exists-p (comp-el-to-eln-filename f d)) (setq found t))))"
+    " (error t))"
+    " (princ f) (terpri))))"
+    " (setq command-line-args-left nil))";
+  char **v = xmallocarray (4 + NATIVE_CHECK_CHUNK + 1, sizeof (*v));
+  size_t next = 0;
+
+  while (next < compiled->count)
+    {
+      size_t first = next;
+      size_t last = next + NATIVE_CHECK_CHUNK < compiled->count ? next + NATIVE_CHECK_CHUNK : compiled->count;
+      char *line = NULL;
+      size_t size = 0;
+      ssize_t length;
+      FILE *stream;
+      pid_t pid;
+      int fds[2];
+      int status;
+      int c = 0;
+
+      v[c++] = "emacs";
+      v[c++] = "--batch";
+      v[c++] = "--eval";
+      v[c++] = (char *) expression;
+      for (size_t i = first; i < last; i++)
+        v[c++] = compiled->files[i];
+      v[c] = NULL;
+
+      if (unlikely (pipe2 (fds, O_CLOEXEC) != 0))
+        edie (errno, "pipe2()");
+      pid = xspawnp (v[0], v, false, fds[1]);
+      close (fds[1]);
+      stream = fdopen (fds[0], "r");
+      if (unlikely (stream == NULL))
+        edie (errno, "fdopen()");
+
+      /* The files come back in order, among whatever Emacs says on
+         stderr.  */
+      while ((length = getline (&line, &size, stream)) > 0)
+        {
+          line[length - 1] = '\0';
+          for (size_t i = next; i < last; i++)
+            if (streq (compiled->files[i], line))
+              {
+                for (; next < i; next++)
+                  free (compiled->files[next]);
+                add_file (stale, compiled->files[next++]);
+                break;
+              }
+        }
+      for (; next < last; next++)
+        free (compiled->files[next]);
+
+      free (line);
+      fclose (stream);
+      status = wait_program_termination (pid);
+      if (!EXITED_SUCCESSFULLY (status))
+        break;
+    }
+
+  for (; next < compiled->count; next++)
+    free (compiled->files[next]);
+  free (compiled->files);
+  free (v);
+}
+
+/* Set warm_jobs if ARG, an option without its dashes, is --warm[=JOBS]
+   and return whether it is.  */
+static bool parse_warm (const char *arg) __nonnull ((1));
+static bool
+parse_warm (const char *arg)
+{
+  char *end;
+
+  if (streq (arg, "warm"))
+    {
+      warm_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+      if (warm_jobs < 1)
+        warm_jobs = 1;
+      return true;
+    }
+  if (!strprefix (arg, "warm="))
+    return false;
+
+  errno = 0;
+  warm_jobs = strtol (arg + strlen ("warm="), &end, 10);
+  if (unlikely (errno != 0 || end == arg + strlen ("warm=") || *end != '\0'
+                || warm_jobs < 1 || warm_jobs > 1024))
+    edie (errno != 0 ? errno : EINVAL, "--%s", arg);
+  return true;
+}
+
+/* Compile the stale Lisp files with warm_jobs workers, reporting the
+   progress on stderr.  Return false if some of them failed.  */
+static bool
+warm_packages (void)
+{
+  static const char expression[] =
+    "(progn (require 'package) (package-activate-all) (require 'bytecomp)"
+    " (dolist (f command-line-args-left)"
+    " (byte-compile-file f)"
+    " (when (and (fboundp 'native-comp-available-p) (native-comp-available-p))"
+    " (ignore-errors (native-compile f))))"
+    " (setq command-line-args-left nil))";
+  struct file_list list = { NULL, 0, 0 };
+  struct file_list compiled = { NULL, 0, 0 };
+  struct pollfd *workers;
+  pid_t *pids;
+  size_t *sizes;
+  char **v;
+  char *log_name;
+  int c = 0;
+  int log;
+  int running = 0;
+  int status;
+  size_t chunk;
+  size_t next = 0;
+  size_t done = 0;
+  size_t failed = 0;
+  size_t crashed = 0;
+  bool progress = isatty (STDERR_FILENO);
+  int phase = trace_begin ("warm");
+
+  v = xmallocarray (3 + 2 * sizeof (lisp_directories) / sizeof (*lisp_directories) + 2 + WARM_MAX_CHUNK + 1, sizeof (*v));
+  v[c++] = "emacs";
+  v[c++] = "--batch";
+  for (size_t i = 0; i < sizeof (lisp_directories) / sizeof (*lisp_directories); i++)
+    {
+      char *directory = home_file (lisp_directories[i]);
+
+      if (directory == NULL)
+        continue;
+      find_stale_lisp_files (directory, &list, &compiled);
+      if (streq (strrchr (lisp_directories[i], '/'), "/lisp"))
+        {
+          v[c++] = "-L";
+          v[c++] = directory;
+        }
+      else
+        free (directory);
+    }
+  v[c++] = "--eval";
+  v[c++] = (char *) expression;
+  find_stale_native_files (&compiled, &list);
+
+  if (list.count == 0)
+    {
+      trace_end (phase);
+      return true;
+    }
+
+  chunk = list.count / (warm_jobs * 4) + 1;
+  if (chunk > WARM_MAX_CHUNK)
+    chunk = WARM_MAX_CHUNK;
+
+  log_name = socket_directory_file ("warm.log");
+  log = open (log_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (unlikely (log < 0))
+    edie (errno, "open(%s)", log_name);
+
+  workers = xmallocarray (warm_jobs, sizeof (*workers));
+  pids = xmallocarray (warm_jobs, sizeof (*pids));
+  sizes = xmallocarray (warm_jobs, sizeof (*sizes));
+
+  if (progress)
+    fprintf (stderr, "Compiling %zu files with %ld workers...", list.count, warm_jobs);
+
+  while (next < list.count || running > 0)
+    {
+      while (running < warm_jobs && next < list.count)
+        {
+          size_t n = list.count - next < chunk ? list.count - next : chunk;
+
+          memcpy (v + c, list.files + next, n * sizeof (*v));
+          v[c + n] = NULL;
+          next += n;
+
+          pids[running] = xspawnp (v[0], v, false, log);
+          sizes[running] = n;
+          workers[running].fd = pidfd_of (pids[running]);
+          workers[running].events = POLLIN;
+          if (workers[running].fd < 0)
+            {
+              /* Without pidfds the pool degrades to a single worker.  */
+              status = wait_program_termination (pids[running]);
+              crashed += !EXITED_SUCCESSFULLY (status);
+              done += n;
+            }
+          else
+            running++;
+        }
+
+      if (running != 0 && poll (workers, running, -1) < 0)
+        {
+          if (unlikely (errno != EINTR))
+            edie (errno, "poll()");
+          continue;
+        }
+
+      for (int i = running - 1; i >= 0; i--)
+        if (workers[i].revents != 0)
+          {
+            close (workers[i].fd);
+            status = wait_program_termination (pids[i]);
+            crashed += !EXITED_SUCCESSFULLY (status);
+            done += sizes[i];
+            running--;
+            workers[i] = workers[running];
+            pids[i] = pids[running];
+            sizes[i] = sizes[running];
+          }
+
+      if (progress)
+        fprintf (stderr, "\rCompiling %zu files with %ld workers... %zu%%",
+                 list.count, warm_jobs, done * 100 / list.count);
+    }
+
+  if (progress)
+    fputc ('\n', stderr);
+  close (log);
+
+  /* Whatever is still stale has failed to compile.  */
+  for (size_t i = 0; i < list.count; i++)
+    {
+      failed += lisp_file_state (list.files[i]) == LISP_FILE_STALE;
+      free (list.files[i]);
+    }
+  if (failed != 0)
+    error (0, 0, "%zu of %zu files failed to compile, see %s",
+           failed, list.count, log_name);
+  else if (crashed != 0)
+    error (0, 0, "%zu workers failed, see %s", crashed, log_name);
+
+  for (int i = 2; i < c; i++)
+    if (streq (v[i], "-L"))
+      free (v[++i]);
+  free (v);
+  free (list.files);
+  free (workers);
+  free (pids);
+  free (sizes);
+  free (log_name);
+  trace_end (phase);
+
+  return failed == 0 && crashed == 0;
+}
+
+/* Socket activation.  Instead of waiting for Emacs to bind its socket
+   once the init files are loaded, tem --listend NAME binds and listens
+   on NAME and then becomes emacs --fg-daemon=NAME with the socket passed
+   as systemd does, through LISTEN_PID and LISTEN_FDS.  Clients connect
+   at once and wait in the backlog until Emacs starts serving.  Emacs
+   has to be built with libsystemd for that.  The socket is bound by the
+   process that becomes Emacs, and Emacs does not fork, so SO_PEERCRED
+   of the connections still names the daemon.  */
+static bool socket_activation = false;
+
+/* The first descriptor passed by socket activation.  */
+#define LISTEN_FDS_START 3
+
+static bool placement_requested (void) __warn_unused_result;
+static int placement_options (char **v, int c) __nonnull ((1)) __warn_unused_result;
+
+/* Whether the daemon is started through tem, see daemon_arguments.  */
+static bool
+daemon_trampoline (void)
+{
+  return socket_activation || placement_requested ();
+}
+
+/* Return the argument vector of an Emacs daemon listening on NAME.
+   ARGV[0] is skipped, the rest of arguments are passed to emacs.  With
+   socket activation the vector starts with tem --listend NAME, and with
+   resource controls with tem --placed NAME, either to be run as
+   /proc/self/exe.  Set *OPTION to the string to free with the vector.  */
+static char **daemon_arguments (const char *name, int argc, char **argv, char **option) __nonnull ((1, 4)) __returns_nonnull __warn_unused_result;
+static char **
+daemon_arguments (const char *name, int argc, char **argv, char **option)
+{
+  int i;
+  int c;
+  char **v;
+  char *d;
+  const char *prefix = socket_activation ? "--fg-daemon=" : "--daemon=";
+
+  d = xmalloc (strlen (prefix) + strlen (name) + 1);
+  xsprintf (d, "%s%s", prefix, name);
+  *option = d;
+
+  c = 0;
+  v = xmallocarray (argc + 11, sizeof (*v));
+
+  if (daemon_trampoline ())
+    {
+      v[c++] = "tem";
+      c = placement_options (v, c);
+      v[c++] = socket_activation ? "--listend" : "--placed";
+      v[c++] = (char *) name;
+    }
+  v[c++] = "emacs";
+  v[c++] = d;
+  if (dump_file_argument () != NULL)
+    {
+      /* The init files are part of the image already.  */
+      v[c++] = (char *) dump_file_argument ();
+      v[c++] = "-q";
+    }
+
+  i = 1;
+  while (i < argc)
+    v[c++] = argv[i++];
+  v[c] = NULL;
+
+  return v;
+}
+
+/* Resource controls.  The daemon is placed in a cgroup v2 of its own,
+   tem.slice/NAME in the user's delegated user@UID.service subtree, with
+   cpu.weight, io.weight and memory.high set as requested.  Whatever
+   the delegation does not allow falls back to nice for the CPU weight
+   and the best-effort I/O priority for the I/O weight.  CPU affinity is
+   always set with sched_setaffinity.  It is all set by tem --placed
+   NAME, or --listend NAME, on itself before it becomes the daemon, so
+   that the client and the helpers it starts keep their own.  */
+
+/* Zero or NULL when not requested.  */
+static unsigned long cpu_weight = 0;
+static unsigned long io_weight = 0;
+static uint64_t memory_high = 0;
+static const char *cpu_list = NULL;
+
+static bool
+placement_requested (void)
+{
+  return cpu_weight != 0 || io_weight != 0 || memory_high != 0 || cpu_list != NULL;
+}
+
+/* Append the options that request the resource controls to V, which
+   has C elements, and return the new number of them.  */
+static int
+placement_options (char **v, int c)
+{
+  static char cpu[sizeof ("--cpu-weight=") + INT_STRLEN_BOUND (unsigned long)];
+  static char io[sizeof ("--io-weight=") + INT_STRLEN_BOUND (unsigned long)];
+  static char memory[sizeof ("--memory-high=") + INT_STRLEN_BOUND (uint64_t)];
+  static char *cpus = NULL;
+
+  if (cpu_weight != 0)
+    {
+      xsprintf (cpu, "--cpu-weight=%lu", cpu_weight);
+      v[c++] = cpu;
+    }
+  if (io_weight != 0)
+    {
+      xsprintf (io, "--io-weight=%lu", io_weight);
+      v[c++] = io;
+    }
+  if (memory_high != 0)
+    {
+      xsprintf (memory, "--memory-high=%" PRIu64, memory_high);
+      v[c++] = memory;
+    }
+  if (cpu_list != NULL)
+    {
+      if (cpus == NULL)
+        {
+          cpus = xmalloc (strlen ("--cpus=") + strlen (cpu_list) + 1);
+          xsprintf (cpus, "--cpus=%s", cpu_list);
+        }
+      v[c++] = cpus;
+    }
+
+  return c;
+}
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_SLICE "tem.slice"
+
+/* Write VALUE to FILE in DIRECTORY.  Return whether that succeeded.  */
+static bool write_control (const char *directory, const char *file, const char *value) __nonnull ((1, 2, 3));
+static bool
+write_control (const char *directory, const char *file, const char *value)
+{
+  char *name = xmalloc (strlen (directory) + 1 + strlen (file) + 1);
+  ssize_t length = strlen (value);
+  bool written;
+  int fd;
+
+  xsprintf (name, "%s/%s", directory, file);
+  fd = open (name, O_WRONLY | O_CLOEXEC);
+  free (name);
+  if (fd < 0)
+    return false;
+
+  written = write (fd, value, length) == length;
+  close (fd);
+  return written;
+}
+
+/* Return the cgroup v2 directory of the user's delegated subtree this
+   process is in, or NULL if it is not in one.  */
+static char *delegated_cgroup (void) __warn_unused_result;
+static char *
+delegated_cgroup (void)
+{
+  char service[sizeof ("/user@.service") + INT_STRLEN_BOUND (uid_t)];
+  const char *root = CGROUP_ROOT;
+  char *line = NULL;
+  size_t size = 0;
+  char *directory = NULL;
+  FILE *stream;
+
+  /* With the hybrid hierarchy cgroup v2 is mounted on unified/.  */
+  if (access (CGROUP_ROOT "/cgroup.controllers", F_OK) != 0)
+    root = CGROUP_ROOT "/unified";
+
+  stream = fopen ("/proc/self/cgroup", "re");
+  if (stream == NULL)
+    return NULL;
+
+  xsprintf (service, "/user@%u.service", uid);
+  while (getline (&line, &size, stream) >= 0)
+    if (strprefix (line, "0::/"))
+      {
+        char *end = strstr (line, service);
+
+        if (end != NULL)
+          {
+            end[strlen (service)] = '\0';
+            directory = xmalloc (strlen (root) + strlen (line + 3) + 1);
+            xsprintf (directory, "%s%s", root, line + 3);
+          }
+        break;
+      }
+
+  free (line);
+  fclose (stream);
+  return directory;
+}
+
+/* Move this process to a cgroup of the daemon listening on NAME and set
+   the controls there.  Return the controls that could not be set there,
+   as a subset of "cpu", "io" and "memory" flags.  */
+enum { CONTROL_CPU = 1, CONTROL_IO = 2, CONTROL_MEMORY = 4 };
+static int place_in_cgroup (const char *name) __nonnull ((1));
+static int
+place_in_cgroup (const char *name)
+{
+  static const char *const controllers[] = { "+cpu", "+io", "+memory" };
+  int missing = (cpu_weight != 0 ? CONTROL_CPU : 0)
+                | (io_weight != 0 ? CONTROL_IO : 0)
+                | (memory_high != 0 ? CONTROL_MEMORY : 0);
+  char *service = delegated_cgroup ();
+  char *slice;
+  char *leaf;
+  const char *base = strrchr (name, '/') + 1;
+  char value[INT_STRLEN_BOUND (uint64_t) + sizeof ("default ")];
+
+  if (service == NULL)
+    return missing;
+
+  slice = xmalloc (strlen (service) + 1 + strlen (CGROUP_SLICE) + 1);
+  xsprintf (slice, "%s/%s", service, CGROUP_SLICE);
+  leaf = xmalloc (strlen (slice) + 1 + strlen (base) + 1);
+  xsprintf (leaf, "%s/%s", slice, base);
+
+  /* Controllers can only be enabled for the children of a cgroup whose
+     parent has them enabled; those the delegation lacks fail here.
+     Unlike with xmkdir failures are not fatal, hence mkdirat.  */
+  if (mkdirat (AT_FDCWD, slice, 00755) != 0 && errno != EEXIST)
+    goto out;
+  for (size_t i = 0; i < sizeof (controllers) / sizeof (*controllers); i++)
+    {
+      write_control (service, "cgroup.subtree_control", controllers[i]);
+      write_control (slice, "cgroup.subtree_control", controllers[i]);
+    }
+  if ((mkdirat (AT_FDCWD, leaf, 00755) != 0 && errno != EEXIST)
+      || !write_control (leaf, "cgroup.procs", "0"))
+    goto out;
+
+  if (cpu_weight != 0)
+    {
+      xsprintf (value, "%lu", cpu_weight);
+      if (write_control (leaf, "cpu.weight", value))
+        missing &= ~CONTROL_CPU;
+    }
+  if (io_weight != 0)
+    {
+      xsprintf (value, "default %lu", io_weight);
+      if (write_control (leaf, "io.weight", value))
+        missing &= ~CONTROL_IO;
+    }
+  if (memory_high != 0)
+    {
+      xsprintf (value, "%" PRIu64, memory_high);
+      if (write_control (leaf, "memory.high", value))
+        missing &= ~CONTROL_MEMORY;
+    }
+
+ out:
+  free (leaf);
+  free (slice);
+  free (service);
+  return missing;
+}
+
+/* Return the nice value whose scheduler weight relative to nice 0 is
+   the closest to WEIGHT relative to the default cpu.weight of 100: every
+   nice level is worth about 1.25 times the CPU time of the next.  */
+static int nice_of_weight (unsigned long weight) __attribute__ ((__const__));
+static int
+nice_of_weight (unsigned long weight)
+{
+  double w = weight;
+  int nice = 0;
+
+  while (w < 100 / 1.118 && nice < 19)
+    w *= 1.25, nice++;
+  while (w > 100 * 1.118 && nice > -20)
+    w /= 1.25, nice--;
+  return nice;
+}
+
+/* Return the best-effort I/O priority level, from 0 to 7, for WEIGHT
+   relative to the default io.weight of 100 and the default level 4.  */
+static int ioprio_level_of_weight (unsigned long weight) __attribute__ ((__const__));
+static int
+ioprio_level_of_weight (unsigned long weight)
+{
+  double w = weight;
+  int level = 4;
+
+  while (w < 100 / 1.414 && level < 7)
+    w *= 2, level++;
+  while (w > 100 * 1.414 && level > 0)
+    w /= 2, level--;
+  return level;
+}
+
+/* Parse a CPU list like "0-3,8" into SET.  */
+static void parse_cpu_list (const char *list, cpu_set_t *set) __nonnull ((1, 2));
+static void
+parse_cpu_list (const char *list, cpu_set_t *set)
+{
+  const char *p = list;
+
+  CPU_ZERO (set);
+  do
+    {
+      char *end;
+      unsigned long first = strtoul (p, &end, 10);
+      unsigned long last = first;
+
+      if (end == p)
+        edie (EINVAL, "--cpus=%s", list);
+      if (*end == '-')
+        {
+          p = end + 1;
+          last = strtoul (p, &end, 10);
+          if (end == p)
+            edie (EINVAL, "--cpus=%s", list);
+        }
+      if (first > last || last >= CPU_SETSIZE)
+        edie (EINVAL, "--cpus=%s", list);
+      for (unsigned long cpu = first; cpu <= last; cpu++)
+        CPU_SET (cpu, set);
+      p = end;
+    }
+  while (*p++ == ',');
+
+  if (p[-1] != '\0')
+    edie (EINVAL, "--cpus=%s", list);
+}
+
+/* Apply the resource controls for the daemon listening on NAME to this
+   process, which is about to become the daemon.  Failures are not
+   fatal, the daemon just runs with fewer controls.  */
+static void place_daemon (const char *name) __nonnull ((1));
+static void
+place_daemon (const char *name)
+{
+  int missing;
+  int phase;
+
+  if (!placement_requested ())
+    return;
+
+  phase = trace_begin ("place");
+  missing = place_in_cgroup (name);
+
+  if ((missing & CONTROL_CPU) != 0)
+    setpriority (PRIO_PROCESS, 0, nice_of_weight (cpu_weight));
+#ifdef SYS_ioprio_set
+  if ((missing & CONTROL_IO) != 0)
+    /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_BE.  */
+    syscall (SYS_ioprio_set, 1, 0, (2 << 13) | ioprio_level_of_weight (io_weight));
+#endif
+  if (cpu_list != NULL)
+    {
+      cpu_set_t set;
+      parse_cpu_list (cpu_list, &set);
+      if (sched_setaffinity (0, sizeof (set), &set) != 0)
+        error (0, errno, "sched_setaffinity()");
+    }
+
+  trace_end (phase);
+}
+
+static void start_daemon (const char *name, int argc, char **argv) __nonnull ((1));
+
+/* Replace this process with an Emacs daemon listening on NAME.  */
+static __noreturn void exec_daemon (const char *name, int argc, char **argv) __nonnull ((1));
+static __noreturn void
+exec_daemon (const char *name, int argc, char **argv)
+{
+  char **v;
+  char *option;
+
+  /* Emacs stays in the foreground with socket activation.  */
+  if (socket_activation)
+    {
+      start_daemon (name, argc, argv);
+      exit (EXIT_SUCCESS);
+    }
+
+  v = daemon_arguments (name, argc, argv, &option);
+  setsid ();
+
+  xexecvp (daemon_trampoline () ? "/proc/self/exe" : v[0], v);
+}
+
+static pid_t spawn_daemon (const char *name, int argc, char **argv) __nonnull ((1));
+static pid_t
+spawn_daemon (const char *name, int argc, char **argv)
+{
+  char **v;
+  char *option;
+  pid_t pid;
+
+  v = daemon_arguments (name, argc, argv, &option);
+  pid = xspawnp (daemon_trampoline () ? "/proc/self/exe" : v[0], v, true, -1);
+  free (option);
+  free (v);
+
+  return pid;
+}
+
+/* tem --placed NAME EMACS ARGS...: apply the resource controls for the
+   daemon listening on NAME and become EMACS.  */
+static __noreturn void exec_placed_daemon (int argc, char **argv) __nonnull ((2));
+static __noreturn void
+exec_placed_daemon (int argc, char **argv)
+{
+  if (unlikely (argc < 3))
+    die (EXIT_FAILURE, "Usage: tem --placed NAME EMACS [ARGS...]\n");
+
+  place_daemon (argv[1]);
+  xexecvp (argv[2], argv + 2);
+}
+
+/* tem --listend NAME EMACS ARGS...: listen on NAME and become EMACS
+   with the socket passed as by socket activation.  */
+static __noreturn void exec_listening_daemon (int argc, char **argv) __nonnull ((2));
+static __noreturn void
+exec_listening_daemon (int argc, char **argv)
+{
+  char pid[INT_STRLEN_BOUND (pid_t) + 1];
+  int null;
+  int fd;
+
+  if (unlikely (argc < 3))
+    die (EXIT_FAILURE, "Usage: tem --listend NAME EMACS [ARGS...]\n");
+
+  fd = listen_on (argv[1]);
+  if (fd != LISTEN_FDS_START)
+    {
+      if (unlikely (dup2 (fd, LISTEN_FDS_START) < 0))
+        edie (errno, "dup2()");
+      close (fd);
+    }
+
+  place_daemon (argv[1]);
+
+  /* Emacs in the foreground keeps the standard streams it was started
+     with, and the client's terminal must not be one of them.  Plain
+     --daemon ends up with the same once it is initialized.  */
+  null = open (_PATH_DEVNULL, O_RDWR | O_CLOEXEC);
+  if (unlikely (null < 0))
+    edie (errno, "open(%s)", _PATH_DEVNULL);
+  if (unlikely (dup2 (null, STDIN_FILENO) < 0
+                || dup2 (null, STDOUT_FILENO) < 0
+                || dup2 (null, STDERR_FILENO) < 0))
+    edie (errno, "dup2()");
+  if (null > STDERR_FILENO)
+    close (null);
+
+  /* Emacs checks that the descriptors are meant for it.  */
+  xsprintf (pid, "%d", getpid ());
+  if (unlikely (setenv ("LISTEN_PID", pid, true) != 0
+                || setenv ("LISTEN_FDS", "1", true) != 0))
+    edie (errno, "setenv()");
+
+  xexecvp (argv[2], argv + 2);
+}
+
+/* Serialize daemon startup between concurrent invocations: the lock is
+   held while a daemon is being started, so only one daemon is spawned
+   and the others connect to it once the lock is released.  */
+static int lock_daemon (void) __warn_unused_result;
+static int
+lock_daemon (void)
+{
+  int phase = trace_begin ("lock");
+  char *lock_name = socket_file (".lock");
+  int fd = open (lock_name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+
+  if (unlikely (fd < 0))
+    edie (errno, "open(%s)", lock_name);
+
+  while (unlikely (flock (fd, LOCK_EX) != 0))
+    if (unlikely (errno != EINTR))
+      edie (errno, "flock(%s)", lock_name);
+
+  free (lock_name);
+  trace_end (phase);
+
+  return fd;
+}
+
+static void
+unlock_daemon (int fd)
+{
+  /* Closing the file releases the lock.  */
+  close (fd);
+}
+
+static void start_daemon (const char *name, int argc, char **argv) __nonnull ((1));
+static void
+start_daemon (const char *name, int argc, char **argv)
+{
+  int phase;
+  pid_t pid;
+
+  phase = trace_begin ("spawn");
+  pid = spawn_daemon (name, argc, argv);
+  trace_pid (phase, pid);
+  trace_end (phase);
+
+  phase = trace_begin ("wait");
+  wait_for_daemon (name, pid);
+  trace_end (phase);
+}
+
+/* Replace this process with EDITOR given the FILE arguments in ARGV,
+   positions included, as emacsclient runs ALTERNATE_EDITOR.  */
+static __noreturn void alternate_editor (const char *editor, int argc, char **argv) __nonnull ((1, 3));
+static __noreturn void
+alternate_editor (const char *editor, int argc, char **argv)
+{
+  int c = 0;
+  char **v = xmallocarray (argc + 2, sizeof (*v));
+
+  if (*editor == '\0')
+    die (EXIT_FAILURE, "Can not connect to Emacs daemon.\n");
+
+  v[c++] = (char *) editor;
+  for (int i = 0; i < argc; i++)
+    v[c++] = argv[i];
+  v[c] = NULL;
+
+  xexecvp (v[0], v);
+}
+
+/* Files larger than this many bytes are opened by open_large_file.
+   Zero means to open every file as usual.  */
+static uint64_t large_file_threshold = 256 << 20;
+
+/* How many bytes of a large file are shown.  */
+#define LARGE_FILE_WINDOW (16 << 20)
+
+/* Return the size of FILE if it is a regular file larger than
+   large_file_threshold, zero otherwise.  */
+static uint64_t large_file_size (const char *file) __nonnull ((1)) __warn_unused_result;
+static uint64_t
+large_file_size (const char *file)
+{
+  struct stat sb;
+
+  if (large_file_threshold != 0 && stat (file, &sb) == 0 && S_ISREG (sb.st_mode)
+      && (uint64_t) sb.st_size > large_file_threshold)
+    return sb.st_size;
+  return 0;
+}
+
+/* Ask the server to load the first LARGE_FILE_WINDOW bytes of FILE, an
+   absolute file name, literally in a read-only buffer of its own, so
+   that the daemon shared by every client neither reads nor decodes the
+   whole file.  With SHOW the buffer is shown as well.  */
+static void open_large_file (const char *file, uint64_t size, bool show) __nonnull ((1));
+static void
+open_large_file (const char *file, uint64_t size, bool show)
+{
+  char *literal = lisp_string (file);
+  /* The file name appears once, everything else is bounded.  */
+  char *expression = xmalloc (strlen (literal) + 512);
+
+  xsprintf (expression,
+            "(let* ((f %s)"
+            " (b (generate-new-buffer"
+            " (format \"%%s<literal %%d/%%d bytes>\" (file-name-nondirectory f)"
+            " %d %" PRIu64 "))))"
+            " (with-current-buffer b"
+            " (insert-file-contents-literally f nil 0 %d)"
+            " (setq default-directory (file-name-directory f))"
+            " (set-buffer-modified-p nil)"
+            " (setq buffer-read-only t)"
+            " (goto-char (point-min)))"
+            " %s nil)",
+            literal, LARGE_FILE_WINDOW, size, LARGE_FILE_WINDOW,
+            show ? "(switch-to-buffer b)" : "");
+  send_command ("-suppress-output", NULL);
+  send_command ("-eval", expression);
+
+  free (expression);
+  free (literal);
+}
+
+/* Send FILE to be visited, relative to the working directory, at
+   POSITION unless it is NULL.  */
+static void send_file (const char *file, const char *position) __nonnull ((1));
+static void
+send_file (const char *file, const char *position)
+{
+  uint64_t size = large_file_size (file);
+
+  if (size != 0)
+    {
+      char *name = (char *) file;
+
+      if (file[0] != '/')
+        {
+          name = xmalloc (strlen (current_directory ()) + 1 + strlen (file) + 1);
+          xsprintf (name, "%s/%s", current_directory (), file);
+        }
+      open_large_file (name, size, true);
+      if (name != file)
+        free (name);
+      return;
+    }
+
+  if (position != NULL)
+    send_command ("-position", position);
+
+  send_to_emacs ("-file ");
+  if (file[0] != '/')
+    {
+      quote_argument (current_directory ());
+      send_char_to_emacs ('/');
+    }
+  quote_argument (file);
+  send_char_to_emacs (' ');
+}
+
+/* Parse the number at *S, at most 9 digits so it fits in an int, and
+   advance *S past it.  Return -1 if there is none.  */
+static int parse_number (char **s) __nonnull ((1));
+static int
+parse_number (char **s)
+{
+  size_t n = strspn (*s, "0123456789");
+  int number = 0;
+
+  if (n == 0 || n > 9)
+    return -1;
+  for (; n != 0; n--)
+    number = number * 10 + *(*s)++ - '0';
+  return number;
+}
+
+/* Parse a LINE of the form "+LINE[:COLUMN] FILE", "FILE:LINE[:COLUMN]"
+   followed by anything after a colon, as printed by grep -n and
+   compilers, or just "FILE".  Store the line and column, or zeros when
+   not given, and return the file name which is terminated in place.
+   Return NULL for an empty LINE.  */
+static char *parse_location (char *line, int *lineno, int *column) __nonnull ((1, 2, 3));
+static char *
+parse_location (char *line, int *lineno, int *column)
+{
+  char *s;
+
+  *lineno = *column = 0;
+
+  if (line[0] == '+')
+    {
+      s = line + 1;
+      if ((*lineno = parse_number (&s)) >= 0
+          && (*s != ':' || (s++, (*column = parse_number (&s)) >= 0))
+          && *s == ' ')
+        return s + 1 + strspn (s + 1, " ");
+      *lineno = *column = 0;
+    }
+
+  /* The first ":DIGITS" followed by a colon or the end of line ends
+     the file name, so that "a.c:10:5: error" and "a.c:10:text" work.  */
+  for (s = line; (s = strchr (s, ':')) != NULL; s++)
+    {
+      char *p = s + 1;
+      int l = parse_number (&p);
+      int c = 0;
+
+      if (l < 0 || (*p != ':' && *p != '\0'))
+        continue;
+      if (*p == ':')
+        {
+          char *q = p + 1;
+          c = parse_number (&q);
+          if (c < 0 || (*q != ':' && *q != '\0'))
+            c = 0;
+        }
+      if (s == line)
+        break;
+      *s = '\0';
+      *lineno = l;
+      *column = c;
+      return line;
+    }
+
+  return *line != '\0' ? line : NULL;
+}
+
+/* Locations read from standard input, as records "LINE COLUMN FILE"
+   with an absolute FILE, each terminated by a null byte.  */
+struct locations
+{
+  char *records;
+  size_t size;
+  size_t capacity;
+  size_t count;
+};
+
+/* At most this many locations read from standard input are sent to the
+   server at once.  */
+#define STDIN_BATCH 256
+
+static void add_location (struct locations *locations, const char *file, int lineno, int column) __nonnull ((1, 2));
+static void
+add_location (struct locations *locations, const char *file, int lineno, int column)
+{
+  size_t length = 2 * INT_STRLEN_BOUND (int) + strlen (current_directory ()) + strlen (file) + 4;
+
+  if (locations->capacity - locations->size < length)
+    {
+      locations->capacity = 2 * locations->capacity + length;
+      locations->records = xreallocarray (locations->records, locations->capacity, 1);
+    }
+
+  if (file[0] == '/')
+    length = xsprintf (locations->records + locations->size, "%d %d %s", lineno, column, file);
+  else
+    length = xsprintf (locations->records + locations->size, "%d %d %s/%s",
+                       lineno, column, current_directory (), file);
+  locations->size += length + 1;
+  locations->count++;
+}
+
+/* Split RECORD into its LINENO, COLUMN and the returned file name.  */
+static const char *parse_record (char *record, int *lineno, int *column) __nonnull ((1, 2, 3)) __returns_nonnull;
+static const char *
+parse_record (char *record, int *lineno, int *column)
+{
+  char *s = record;
+
+  *lineno = parse_number (&s);
+  s++;
+  *column = parse_number (&s);
+  return s + 1;
+}
+
+/* Append LOCATIONS to the request as FILE arguments.  */
+static void send_locations (const struct locations *locations) __nonnull ((1));
+static void
+send_locations (const struct locations *locations)
+{
+  for (char *r = locations->records; r < locations->records + locations->size; r += strlen (r) + 1)
+    {
+      char position[1 + 2 * INT_STRLEN_BOUND (int) + 1 + 1];
+      int lineno;
+      int column;
+      const char *file = parse_record (r, &lineno, &column);
+
+      if (column > 0)
+        xsprintf (position, "+%d:%d", lineno, column);
+      else
+        xsprintf (position, "+%d", lineno);
+      send_file (file, (lineno > 0 ? position : NULL));
+    }
+}
+
+/* Visit LOCATIONS in the daemon on a connection of its own without
+   showing them, and wait until it is done with them.  */
+static void visit_in_background (const struct locations *locations) __nonnull ((1));
+static void
+visit_in_background (const struct locations *locations)
+{
+  int request = emacs_socket;
+  char *expression = xmalloc (2 * locations->size + 16 * locations->count + 512);
+  char *end = stpcpy (expression, "(dolist (e '(");
+  char buffer[BUFSIZ];
+  ssize_t received;
+
+  emacs_socket = connect_to_emacs (socket_name);
+  if (unlikely (emacs_socket < 0))
+    edie (errno, "connect(%s)", socket_name);
+  send_command ("-suppress-output", NULL);
+
+  for (char *r = locations->records; r < locations->records + locations->size; r += strlen (r) + 1)
+    {
+      int lineno;
+      int column;
+      const char *file = parse_record (r, &lineno, &column);
+      uint64_t size = large_file_size (file);
+      char *literal;
+
+      if (size != 0)
+        {
+          open_large_file (file, size, false);
+          continue;
+        }
+
+      literal = lisp_string (file);
+      end += xsprintf (end, "(%s %d %d)", literal, lineno, column);
+      free (literal);
+    }
+  stpcpy (end,
+          ")) (ignore-errors"
+          " (with-current-buffer (find-file-noselect (car e))"
+          " (when (> (nth 1 e) 0)"
+          " (goto-char (point-min))"
+          " (forward-line (1- (nth 1 e)))"
+          " (when (> (nth 2 e) 0) (move-to-column (1- (nth 2 e))))))))");
+  send_command ("-eval", expression);
+  send_to_emacs ("\n");
+  flush_to_emacs ();
+  free (expression);
+
+  /* The server closes the connection once the batch is visited.  */
+  while ((received = recv (emacs_socket, buffer, sizeof (buffer), 0)) > 0
+         || (received < 0 && errno == EINTR))
+    continue;
+  close (emacs_socket);
+  emacs_socket = request;
+}
+
+/* Read the locations from standard input.  The first STDIN_BATCH of
+   them are left in FIRST to be shown like FILE arguments, every later
+   batch is visited in the background as soon as it is complete, so
+   that neither we nor the server ever hold more than a batch and the
+   server never gets a request of unbounded size.  */
+static void read_locations_from_stdin (struct locations *first) __nonnull ((1));
+static void
+read_locations_from_stdin (struct locations *first)
+{
+  struct locations rest = { NULL, 0, 0, 0 };
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  int phase = trace_begin ("stdin");
+
+  while ((length = getline (&line, &size, stdin)) >= 0)
+    {
+      char *file;
+      int lineno;
+      int column;
+
+      while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        line[--length] = '\0';
+
+      file = parse_location (line, &lineno, &column);
+      if (file == NULL)
+        continue;
+
+      if (first->count < STDIN_BATCH)
+        add_location (first, file, lineno, column);
+      else
+        {
+          add_location (&rest, file, lineno, column);
+          if (rest.count == STDIN_BATCH)
+            {
+              visit_in_background (&rest);
+              rest.size = rest.count = 0;
+            }
+        }
+    }
+
+  if (unlikely (ferror (stdin)))
+    edie (errno, "stdin");
+  if (rest.count != 0)
+    visit_in_background (&rest);
+
+  free (rest.records);
+  free (line);
+  trace_end (phase);
+}
+
+/* How long standard input may stay silent before what has arrived so
+   far is shown, in milliseconds.  */
+#define STDIN_IDLE 100
+
+/* Return the name by which the daemon can visit standard input given
+   as "-".  A regular file is visited directly.  Anything else is copied
+   to an anonymous file, as much as arrives until the producer goes idle
+   or, with WAIT_FOR_END, all of it; the rest is copied while we wait
+   for the server.  */
+static const char *stdin_file (bool wait_for_end) __returns_nonnull;
+static const char *
+stdin_file (bool wait_for_end)
+{
+  static char name[sizeof ("/proc//fd/") + 2 * INT_STRLEN_BOUND (int)];
+  struct stat sb;
+  int fd = STDIN_FILENO;
+
+  if (*name != '\0')
+    return name;
+
+  if (unlikely (from_stdin))
+    die (EXIT_FAILURE, "Can not open \"-\" with --from-stdin.\n");
+  if (unlikely (isatty (STDIN_FILENO)))
+    die (EXIT_FAILURE, "Standard input is a terminal.\n");
+  if (unlikely (fstat (STDIN_FILENO, &sb) != 0))
+    edie (errno, "stdin");
+
+  if (!S_ISREG (sb.st_mode))
+    {
+      stdin_copy = memfd_create ("tem-stdin", MFD_CLOEXEC);
+      if (stdin_copy < 0)
+        stdin_copy = open (socket_directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 00600);
+      if (unlikely (stdin_copy < 0))
+        edie (errno, "memfd_create()");
+      stdin_streaming = copy_stdin (wait_for_end ? -1 : STDIN_IDLE);
+      fd = stdin_copy;
+    }
+
+  xsprintf (name, "/proc/%d/fd/%d", getpid (), fd);
+  return name;
+}
+
+/* Frame pool.  A tty frame is bound to the terminal it is opened on, so
+   it can not be made in advance, but a graphical one can: with
+   --frame-pool=N the daemon keeps N hidden, fully initialised frames per
+   display.  An invocation without a terminal shows a frame already
+   visible on its display, or else takes one from the pool, which is
+   refilled from a timer once the request is served.  An invocation from
+   a shell inside Emacs reuses the selected frame instead of opening a
+   frame on the terminal of that shell.  */
+static unsigned int frame_pool = 0;
+
+#define FRAME_POOL_SIZE 2
+
+#define FRAME_POOL                                                            \
+  "(progn"                                                                    \
+  " (defun tem-frame-pool--find (display pooled visible)"                     \
+  " (catch 'found"                                                            \
+  " (dolist (f (frame-list))"                                                 \
+  " (when (and (equal (frame-parameter f 'display) display)"                  \
+  " (eq (and (frame-parameter f 'tem-pool) t) pooled)"                        \
+  " (or (not visible) (eq (frame-visible-p f) t)))"                           \
+  " (throw 'found f)))))"                                                     \
+  " (defun tem-frame-pool--fill (display size)"                               \
+  " (ignore-errors"                                                           \
+  " (let ((n 0))"                                                             \
+  " (dolist (f (frame-list))"                                                 \
+  " (when (and (frame-parameter f 'tem-pool)"                                 \
+  " (equal (frame-parameter f 'display) display))"                            \
+  " (setq n (1+ n))))"                                                        \
+  " (while (< n size)"                                                        \
+  " (make-frame-on-display display '((visibility) (tem-pool . t)))"           \
+  " (setq n (1+ n))))))"                                                      \
+  " (defun tem-frame-pool--take (display size)"                               \
+  " (let ((f (selected-frame)))"                                              \
+  " (unless (and (equal (frame-parameter f 'display) display)"                \
+  " (eq (frame-visible-p f) t))"                                              \
+  " (setq f (or (tem-frame-pool--find display nil t)"                         \
+  " (tem-frame-pool--find display t nil)"                                     \
+  " (make-frame-on-display display))))"                                       \
+  " (set-frame-parameter f 'tem-pool nil)"                                    \
+  " (make-frame-visible f)"                                                   \
+  " (select-frame-set-input-focus f))"                                        \
+  " (run-with-timer 0 nil #'tem-frame-pool--fill display size))"
+
+/* Parse VALUE of OPTION as the size of the frame pool, 0 disables it.  */
+static unsigned int parse_frame_pool (const char *option, const char *value) __nonnull ((1, 2)) __warn_unused_result;
+static unsigned int
+parse_frame_pool (const char *option, const char *value)
+{
+  char *end;
+  unsigned long size;
+
+  errno = 0;
+  size = strtoul (value, &end, 10);
+  if (unlikely (errno != 0 || end == value || *end != '\0' || size > 64))
+    edie (errno != 0 ? errno : EINVAL, "%s", option);
+
+  return size;
+}
+
+/* Return the graphical display frames would be opened on, or NULL.  */
+static const char *graphical_display (void) __warn_unused_result;
+static const char *
+graphical_display (void)
+{
+  const char *display = getenv ("DISPLAY");
+
+  if (display == NULL || *display == '\0')
+    display = getenv ("WAYLAND_DISPLAY");
+  return display != NULL && *display != '\0' ? display : NULL;
+}
+
+/* Send the -eval that shows a frame on DISPLAY, see FRAME_POOL.  */
+static void send_frame_pool (const char *display) __nonnull ((1));
+static void
+send_frame_pool (const char *display)
+{
+  char *literal = lisp_string (display);
+  char *expression = xmalloc (strlen (FRAME_POOL) + strlen (literal)
+                              + INT_STRLEN_BOUND (unsigned int) + 64);
+
+  xsprintf (expression, FRAME_POOL " (tem-frame-pool--take %s %u))",
+            literal, frame_pool);
+  send_command ("-eval", expression);
+
+  free (expression);
+  free (literal);
+}
+
+/* Fill the pool of a freshly started daemon in the background.  */
+static void
+prime_frame_pool (void)
+{
+  const char *display = graphical_display ();
+  char *literal;
+  char *expression;
+
+  if (frame_pool == 0 || display == NULL)
+    return;
+
+  literal = lisp_string (display);
+  expression = xmalloc (strlen (FRAME_POOL) + strlen (literal)
+                        + INT_STRLEN_BOUND (unsigned int) + 64);
+  xsprintf (expression, FRAME_POOL " (run-with-timer 0 nil #'tem-frame-pool--fill %s %u))",
+            literal, frame_pool);
+  eval_in_daemon (socket_name, expression, false);
+
+  free (expression);
+  free (literal);
+}
+
+/* Open queue.  While a daemon is busy, e --no-wait FILE... appends its
+   files to SOCKET.spool and returns at once, and a single tem --drain
+   sends everything queued in one request whenever the daemon is free
+   again.  The drainer holds a lock on SOCKET.drain for as long as it
+   runs.  An invocation that finds the drain lock free talks to the
+   daemon itself, and queues its files and hands the lock over to a new
+   drainer if there is no answer within SPOOL_BUSY_TIMEOUT.  The spool is locked while it
+   is read or written, and the drainer gives up its lock only while it
+   holds the spool one and has found it empty, so nothing is ever left
+   behind.  Records are "LINE COLUMN FILE\0", and an open of a FILE
+   already queued at the same position is dropped.  At most SPOOL_DEPTH
+   records are queued, and further invocations wait for the drainer to
+   take them.  */
+#define SPOOL_DEPTH 256
+#define SPOOL_BUSY_TIMEOUT 50
+
+/* The drain lock, while this process holds it.  */
+static int drain_lock = -1;
+
+/* Open the spool and lock it.  */
+static int open_spool (void) __warn_unused_result;
+static int
+open_spool (void)
+{
+  char *spool_name = socket_file (".spool");
+  int fd = open (spool_name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+
+  if (unlikely (fd < 0))
+    edie (errno, "open(%s)", spool_name);
+  while (unlikely (flock (fd, LOCK_EX) != 0))
+    if (unlikely (errno != EINTR))
+      edie (errno, "flock(%s)", spool_name);
+
+  free (spool_name);
+  return fd;
+}
+
+/* Return the contents of the locked SPOOL and store their length and
+   the number of records in it.  */
+static char *read_spool (int spool, size_t *length, size_t *count) __nonnull ((2, 3)) __returns_nonnull __warn_unused_result;
+static char *
+read_spool (int spool, size_t *length, size_t *count)
+{
+  struct stat sb;
+  char *records;
+  ssize_t n;
+
+  if (unlikely (fstat (spool, &sb) != 0))
+    edie (errno, "fstat()");
+
+  records = xmalloc (sb.st_size + 1);
+  n = pread (spool, records, sb.st_size, 0);
+  if (unlikely (n < 0))
+    edie (errno, "read()");
+
+  *length = n;
+  *count = 0;
+  for (ssize_t i = 0; i < n; i++)
+    *count += records[i] == '\0';
+  return records;
+}
+
+/* Try to take the drain lock.  Return false if a drainer holds it.  */
+static bool
+take_drain_lock (void)
+{
+  if (drain_lock < 0)
+    {
+      char *lock_name = socket_file (".drain");
+
+      drain_lock = open (lock_name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+      if (unlikely (drain_lock < 0))
+        edie (errno, "open(%s)", lock_name);
+      free (lock_name);
+    }
+
+  while (flock (drain_lock, LOCK_EX | LOCK_NB) != 0)
+    if (unlikely (errno != EINTR))
+      {
+        if (unlikely (errno != EWOULDBLOCK))
+          edie (errno, "flock()");
+        return false;
+      }
+  return true;
+}
+
+/* Hand the drain lock over to a new tem --drain in background.  */
+static void
+spawn_drainer (void)
+{
+  char fd[INT_STRLEN_BOUND (int) + 1];
+  char *name = NULL;
+  char *v[5];
+  int c = 0;
+  int null;
+  int phase = trace_begin ("drainer");
+
+  xsprintf (fd, "%d", drain_lock);
+  v[c++] = "tem";
+  if (daemon_name != NULL)
+    {
+      name = xmalloc (strlen ("--name=") + strlen (daemon_name) + 1);
+      xsprintf (name, "--name=%s", daemon_name);
+      v[c++] = name;
+    }
+  v[c++] = "--drain";
+  v[c++] = fd;
+  v[c] = NULL;
+
+  /* The lock belongs to the open file, which the drainer inherits.  */
+  if (unlikely (fcntl (drain_lock, F_SETFD, 0) != 0))
+    edie (errno, "fcntl()");
+  null = open (_PATH_DEVNULL, O_RDWR | O_CLOEXEC);
+  trace_pid (phase, xspawnp ("/proc/self/exe", v, true, null));
+  if (null >= 0)
+    close (null);
+  close (drain_lock);
+  drain_lock = -1;
+  free (name);
+  trace_end (phase);
+}
+
+/* Whether the FILE arguments in ARGV can be queued: none of them is
+   standard input or a large file.  */
+static bool spoolable (int argc, char **argv) __nonnull ((2)) __warn_unused_result;
+static bool
+spoolable (int argc, char **argv)
+{
+  for (int i = 0; i < argc; i++)
+    {
+      struct stat sb;
+
+      if (argv[i][0] == '+')
+        continue;
+      if (streq (argv[i], "-"))
+        return false;
+      if (large_file_threshold != 0 && stat (argv[i], &sb) == 0
+          && S_ISREG (sb.st_mode) && (uint64_t) sb.st_size > large_file_threshold)
+        return false;
+    }
+  return true;
+}
+
+/* Queue the files in ARGV in the locked *SPOOL, see SPOOL_DEPTH.  */
+static void enqueue_files (int *spool, int argc, char **argv) __nonnull ((1, 3));
+static void
+enqueue_files (int *spool, int argc, char **argv)
+{
+  const char *position = NULL;
+
+  for (int i = 0; i < argc; i++)
+    {
+      const char *file = argv[i];
+      char *record;
+      int length;
+      int lineno = 0;
+      int column = 0;
+      int backoff = 1;
+
+      if (file[0] == '+' && file[1 + strspn (file + 1, "0123456789:")] == '\0')
+        {
+          position = file;
+          continue;
+        }
+      if (position != NULL)
+        {
+          char *s = (char *) position + 1;
+
+          lineno = parse_number (&s);
+          if (*s == ':')
+            {
+              s++;
+              column = parse_number (&s);
+            }
+          lineno = lineno < 0 ? 0 : lineno;
+          column = column < 0 ? 0 : column;
+          position = NULL;
+        }
+
+      record = xmalloc (2 * INT_STRLEN_BOUND (int) + strlen (current_directory ())
+                        + strlen (file) + 4);
+      if (file[0] == '/')
+        length = xsprintf (record, "%d %d %s", lineno, column, file);
+      else
+        length = xsprintf (record, "%d %d %s/%s", lineno, column, current_directory (), file);
+
+      while (true)
+        {
+          size_t size;
+          size_t count;
+          char *records = read_spool (*spool, &size, &count);
+          bool queued = false;
+
+          for (char *r = records; r < records + size; r += strlen (r) + 1)
+            if (streq (r, record))
+              {
+                queued = true;
+                break;
+              }
+          free (records);
+
+          if (queued)
+            break;
+          if (count < SPOOL_DEPTH)
+            {
+              if (unlikely (pwrite (*spool, record, length + 1, size) != length + 1))
+                edie (errno, "write()");
+              break;
+            }
+
+          /* The spool is full, wait for the drainer to take it, and
+             start one if it is gone.  */
+          if (take_drain_lock ())
+            spawn_drainer ();
+          close (*spool);
+          poll (NULL, 0, backoff);
+          if (backoff < 100)
+            backoff *= 2;
+          *spool = open_spool ();
+        }
+
+      free (record);
+    }
+}
+
+/* tem --drain FD: visit the queued files whenever the daemon is free,
+   holding the drain lock FD until the spool is empty.  */
+static __noreturn void drain_spool (int argc, char **argv) __nonnull ((2));
+static __noreturn void
+drain_spool (int argc, char **argv)
+{
+  char *end;
+  long fd;
+
+  if (unlikely (argc < 2))
+    die (EXIT_FAILURE, "Usage: tem --drain FD\n");
+  errno = 0;
+  fd = strtol (argv[1], &end, 10);
+  if (unlikely (errno != 0 || end == argv[1] || *end != '\0' || fd < 0 || fd > INT_MAX))
+    error (EXIT_FAILURE, 0, "Invalid file descriptor: %s", argv[1]);
+  drain_lock = fd;
+  if (unlikely (fcntl (drain_lock, F_SETFD, FD_CLOEXEC) != 0))
+    edie (errno, "fcntl(%d)", drain_lock);
+
+  /* This waits until the daemon is done with whatever it is busy with,
+     meanwhile the spool fills up.  */
+  if (unlikely (eval_in_daemon (socket_name, "nil", false) != EXIT_SUCCESS))
+    exit (EXIT_FAILURE);
+
+  while (true)
+    {
+      struct locations locations;
+      int spool = open_spool ();
+
+      locations.records = read_spool (spool, &locations.size, &locations.count);
+      locations.capacity = locations.size;
+      if (locations.count == 0)
+        {
+          close (drain_lock);
+          close (spool);
+          exit (EXIT_SUCCESS);
+        }
+      if (unlikely (ftruncate (spool, 0) != 0))
+        edie (errno, "ftruncate()");
+      close (spool);
+
+      /* The request e --no-wait would have sent, so that the server
+         runs its usual hooks and shows the last file in the selected
+         frame.  */
+      emacs_socket = connect_to_emacs (socket_name);
+      if (unlikely (emacs_socket < 0))
+        edie (errno, "connect(%s)", socket_name);
+      send_environment_and_directory ();
+      send_command ("-nowait", NULL);
+      send_command ("-current-frame", NULL);
+      send_locations (&locations);
+      send_to_emacs ("\n");
+      flush_to_emacs ();
+      receive_from_emacs ();
+      close (emacs_socket);
+      emacs_socket = -1;
+
+      free (locations.records);
+    }
+}
+
+/* Send the daemon connected on emacs_socket a request that needs no
+   frame, and return whether it starts to answer within
+   response_timeout.  The server takes a single request per connection,
+   so the connection is closed afterwards.  */
+static bool
+daemon_responds (void)
+{
+  struct pollfd reply = { .fd = emacs_socket, .events = POLLIN };
+  uint64_t deadline = monotonic_ns () + response_timeout * 1000000;
+  int phase = trace_begin ("ping");
+  int n;
+
+  send_command ("-eval", "nil");
+  send_to_emacs ("\n");
+  flush_to_emacs ();
+
+  do
+    {
+      uint64_t now = monotonic_ns ();
+      n = poll (&reply, 1, now < deadline ? (deadline - now + 999999) / 1000000 : 0);
+    }
+  while (n < 0 && errno == EINTR);
+
+  close (emacs_socket);
+  emacs_socket = -1;
+  trace_end (phase);
+
+  return n > 0;
+}
+
+static __noreturn void
+start_client (int argc, char **argv)
+{
+  static const struct option long_options[] =
+    {
+      { "no-wait",          no_argument,       NULL, 'n' },
+      { "quiet",            no_argument,       NULL, 'q' },
+      { "suppress-output",  no_argument,       NULL, 'u' },
+      { "eval",             no_argument,       NULL, 'e' },
+      { "tty",              no_argument,       NULL, 't' },
+      { "nw",               no_argument,       NULL, 't' },
+      { "create-frame",     no_argument,       NULL, 'c' },
+      { "alternate-editor", required_argument, NULL, 'a' },
+      { NULL,               0,                 NULL, 0   }
+    };
+
+  int c;
+  bool nowait = false;
+  bool quiet = false;
+  bool eval = false;
+  const char *editor = get_alternate_editor ();
+  const char *tty_name;
+  const char *tty_type;
+  const char *display = NULL;
+  const char *position = NULL;
+  struct locations stdin_locations = { NULL, 0, 0, 0 };
+  int phase;
+  int status;
+
+  while ((c = getopt_long_only (argc, argv, "nquetca:", long_options, NULL)) != -1)
+    switch (c)
+      {
+      case 'n':
+        nowait = true;
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      case 'u':
+        suppress_output = true;
+        break;
+      case 'e':
+        eval = true;
+        break;
+      case 't':
+      case 'c':
+        /* We always open a new terminal frame.  */
+        break;
+      case 'a':
+        editor = optarg;
+        break;
+      default:
+        usage (EXIT_FAILURE);
+      }
+
+  argc -= optind;
+  argv += optind;
+
+  /* A frame opened on the terminal with -nowait would outlive us, so
+     the files go to the frame the daemon has selected, as with
+     emacsclient -n.  Like emacsclient -t, ignore -n with -e.  */
+  if (eval)
+    nowait = false;
+
+  tty_type = getenv ("TERM");
+  tty_name = ttyname (STDOUT_FILENO);
+  if (tty_name == NULL && frame_pool != 0 && !eval)
+    display = graphical_display ();
+  tty = display == NULL && !nowait;
+  if (unlikely (tty && tty_name == NULL))
+    die (EXIT_FAILURE, "Could not get terminal name.\n");
+  if (unlikely (tty && tty_type == NULL))
+    die (EXIT_FAILURE, "Please set the TERM variable to your terminal type.\n");
+
+  /* Queue the files if a drainer is waiting for the daemon already,
+     otherwise find out whether the daemon is busy.  */
+  if (nowait && !from_stdin && display == NULL && spoolable (argc, argv))
+    {
+      int spool;
+
+      phase = trace_begin ("spool");
+      spool = open_spool ();
+      if (!take_drain_lock ())
+        {
+          enqueue_files (&spool, argc, argv);
+          close (spool);
+          trace_end (phase);
+          exit (EXIT_SUCCESS);
+        }
+      close (spool);
+      trace_end (phase);
+
+      if (response_timeout == 0 || response_timeout > SPOOL_BUSY_TIMEOUT)
+        response_timeout = SPOOL_BUSY_TIMEOUT;
+    }
+
+  /* Later batches are visited before the request shows the first,
+     and the server may not serve them while our connection is idle.  */
+  if (from_stdin)
+    {
+      if (emacs_socket >= 0)
+        close (emacs_socket);
+      emacs_socket = -1;
+      read_locations_from_stdin (&stdin_locations);
+    }
+
+  if (emacs_socket < 0)
+    {
+      phase = trace_begin ("connect");
+      emacs_socket = connect_to_emacs (socket_name);
+      trace_end (phase);
+    }
+  if (unlikely (emacs_socket < 0))
+    alternate_editor (editor, argc, argv);
+
+  /* A frame the daemon opened after we gave up on it would fight the
+     alternate editor for the terminal.  So the daemon has to answer a
+     cheap request within the timeout first, and then the frame is
+     waited for however long it takes.  */
+  if (response_timeout != 0 && (tty || display != NULL))
+    {
+      if (!daemon_responds ())
+        {
+          if (*editor == '\0')
+            error (EXIT_FAILURE, 0, "Emacs daemon did not respond within %" PRIu64 " ms "
+                   "(see --response-timeout)", response_timeout);
+          alternate_editor (editor, argc, argv);
+        }
+      response_timeout = 0;
+
+      phase = trace_begin ("connect");
+      emacs_socket = connect_to_emacs (socket_name);
+      trace_end (phase);
+      if (unlikely (emacs_socket < 0))
+        alternate_editor (editor, argc, argv);
+    }
+
+  phase = trace_begin ("request");
+
+  send_environment_and_directory ();
+  if (nowait)
+    send_command ("-nowait", NULL);
+  if (quiet)
+    send_command ("-quiet", NULL);
+  if (suppress_output)
+    send_command ("-suppress-output", NULL);
+
+  if (display != NULL)
+    {
+      /* The daemon has a frame on the display, or makes a client frame
+         if it has none at all.  The -eval from send_frame_pool picks the
+         frame to show.  */
+      send_command ("-display", display);
+      send_command ("-current-frame", NULL);
+      if (!suppress_output)
+        send_command ("-suppress-output", NULL);
+      suppress_output = true;
+    }
+  else if (nowait)
+    send_command ("-current-frame", NULL);
+  else
+    {
+      send_to_emacs ("-tty ");
+      quote_argument (tty_name);
+      send_char_to_emacs (' ');
+      quote_argument (tty_type);
+      send_char_to_emacs (' ');
+
+      /* The server still opens a frame on the terminal if the daemon
+         has no frame to reuse.  */
+      if (frame_pool != 0 && !eval && getenv ("INSIDE_EMACS") != NULL)
+        send_command ("-current-frame", NULL);
+    }
+
+  for (int i = 0; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (eval)
+        {
+          send_command ("-eval", arg);
+          continue;
+        }
+
+      if (arg[0] == '+' && arg[1 + strspn (arg + 1, "0123456789:")] == '\0')
+        {
+          position = arg;
+          continue;
+        }
+
+      if (streq (arg, "-"))
+        arg = stdin_file (nowait);
+      send_file (arg, position);
+      position = NULL;
+    }
+
+  if (from_stdin)
+    {
+      send_locations (&stdin_locations);
+      free (stdin_locations.records);
+    }
+
+  if (display != NULL)
+    send_frame_pool (display);
+
+  if (stdin_streaming)
+    {
+      /* Let the buffer follow what is still being written.  */
+      char *file = lisp_string (stdin_file (nowait));
+      char *expression = xmalloc (strlen (file) + 128);
+
+      xsprintf (expression,
+                "(let ((b (find-buffer-visiting %s)))"
+                " (when b (with-current-buffer b (auto-revert-tail-mode 1))))",
+                file);
+      send_command ("-suppress-output", NULL);
+      send_command ("-eval", expression);
+      free (expression);
+      free (file);
+    }
+
+  send_to_emacs ("\n");
+  flush_to_emacs ();
+  trace_end (phase);
+
+  reply_phase = trace_begin ("reply");
+  status = receive_from_emacs ();
+
+  if (drain_lock >= 0)
+    {
+      /* What was queued meanwhile is left to a drainer.  Without an
+         answer from the busy daemon, our own files are queued as well:
+         once the server gets to the request, it finds us gone when it
+         sends -emacs-pid and drops it.  A drainer may have taken over
+         the lock while the spool was full, and then sends them.  */
+      struct stat sb;
+      int spool = open_spool ();
+
+      if (status == NO_RESPONSE)
+        {
+          close (emacs_socket);
+          enqueue_files (&spool, argc, argv);
+        }
+      if (take_drain_lock ()
+          && (status == NO_RESPONSE || (fstat (spool, &sb) == 0 && sb.st_size != 0)))
+        spawn_drainer ();
+      close (spool);
+      if (status == NO_RESPONSE)
+        exit (EXIT_SUCCESS);
+    }
+  if (unlikely (status == NO_RESPONSE))
+    {
+      close (emacs_socket);
+      if (*editor == '\0')
+        error (EXIT_FAILURE, 0, "Emacs daemon did not respond within %" PRIu64 " ms "
+               "(see --response-timeout)", response_timeout);
+      alternate_editor (editor, argc, argv);
+    }
+
+  exit (status);
+}
+/* Session snapshots.  Before a daemon is stopped or restarted, it
+   writes the files it visits with their points and major modes to
+   SOCKET.session, and the next daemon started on the same socket reads
+   them back.  The buffers are restored lazily: they are only created
+   as empty placeholders, and each is replaced by the visited file when
+   it is first displayed in a window.  */
+
+static bool keep_session = true;
+
+/* Write the session to the file named by the string literal %1$s.
+   Placeholders that were never displayed are saved as they are.  */
+#define SAVE_SESSION                                                          \
+  "(ignore-errors"                                                            \
+  " (let (session)"                                                           \
+  " (dolist (b (buffer-list))"                                                \
+  " (with-current-buffer b"                                                   \
+  " (cond ((and buffer-file-name (not (string-prefix-p \"/proc/\" buffer-file-name)))" \
+  " (push (list buffer-file-name (point) major-mode) session))"               \
+  " ((bound-and-true-p tem-session--file)"                                    \
+  " (push (list tem-session--file tem-session--point tem-session--mode) session)))))" \
+  " (with-temp-file %1$s (prin1 (nreverse session) (current-buffer)))) nil)"
+
+/* Restore the session from the file named by the string literal %1$s
+   and remove the file.  A placeholder is turned into the buffer of its
+   file by whatever visits the file first, find-file-noselect through
+   create-file-buffer, be it the server or a window showing it, so that
+   no second buffer is made for the file.  */
+#define RESTORE_SESSION                                                       \
+  "(ignore-errors"                                                            \
+  " (defvar-local tem-session--file nil)"                                     \
+  " (defvar-local tem-session--point nil)"                                    \
+  " (defvar-local tem-session--mode nil)"                                     \
+  " (defvar tem-session--pending nil)"                                        \
+  " (defun tem-session--placeholder (file)"                                   \
+  " (let ((file (expand-file-name file)))"                                    \
+  " (catch 'found (dolist (b (buffer-list))"                                  \
+  " (when (equal (buffer-local-value 'tem-session--file b) file)"             \
+  " (throw 'found b))))))"                                                    \
+  " (defun tem-session--reuse (create file)"                                  \
+  " (let ((b (tem-session--placeholder file)))"                               \
+  " (if (null b) (funcall create file)"                                       \
+  " (with-current-buffer b"                                                   \
+  " (push (list b tem-session--point tem-session--mode) tem-session--pending)" \
+  " (setq tem-session--file nil))"                                            \
+  " b)))"                                                                     \
+  " (advice-add 'create-file-buffer :around #'tem-session--reuse)"            \
+  " (defun tem-session--restore ()"                                           \
+  " (let ((p (assq (current-buffer) tem-session--pending)))"                  \
+  " (when p"                                                                  \
+  " (setq tem-session--pending (delq p tem-session--pending))"                \
+  " (when (and (nth 2 p) (not (eq (nth 2 p) major-mode)) (fboundp (nth 2 p)))" \
+  " (funcall (nth 2 p)))"                                                     \
+  " (goto-char (nth 1 p)))))"                                                 \
+  " (add-hook 'find-file-hook #'tem-session--restore)"                        \
+  " (defun tem-session--realize (&optional _frame)"                           \
+  " (dolist (w (window-list-1 nil nil t))"                                    \
+  " (let ((b (window-buffer w)))"                                             \
+  " (when (buffer-local-value 'tem-session--file b)"                          \
+  " (let ((pt (buffer-local-value 'tem-session--point b)))"                   \
+  " (set-window-buffer w (find-file-noselect (buffer-local-value 'tem-session--file b)))" \
+  " (set-window-point w pt))))))"                                             \
+  " (add-hook 'window-buffer-change-functions #'tem-session--realize)"        \
+  " (let ((session (with-temp-buffer (insert-file-contents %1$s)"             \
+  " (read (current-buffer)))))"                                               \
+  " (delete-file %1$s)"                                                       \
+  " (dolist (entry session)"                                                  \
+  " (let ((file (car entry)))"                                                \
+  " (when (and (file-exists-p file) (not (find-buffer-visiting file))"        \
+  " (not (tem-session--placeholder file)))"                                   \
+  " (with-current-buffer (create-file-buffer file)"                           \
+  " (setq default-directory (file-name-directory file))"                      \
+  " (setq tem-session--file file"                                             \
+  " tem-session--point (nth 1 entry)"                                         \
+  " tem-session--mode (nth 2 entry)))))))"                                    \
+  " nil)"
+
+/* Return the expression that saves the session of the daemon listening
+   on socket_name to its session file, or with RESTORE, restores it from
+   there, or NULL if there is nothing to do.  */
+static char *session_expression (bool restore) __warn_unused_result;
+static char *
+session_expression (bool restore)
+{
+  const char *format = restore ? RESTORE_SESSION : SAVE_SESSION;
+  char *file = socket_file (".session");
+  char *literal;
+  char *expression = NULL;
+
+  if (keep_session && (!restore || access (file, R_OK) == 0))
+    {
+      literal = lisp_string (file);
+      expression = xmalloc (strlen (format) + 4 * strlen (literal) + 1);
+      xsprintf (expression, format, literal);
+      free (literal);
+    }
+
+  free (file);
+  return expression;
+}
+
+/* Save the session of the daemon listening on socket_name to its
+   session file, or with RESTORE, restore it from there, in the daemon
+   listening on NAME.  */
+static void session_eval (const char *name, bool restore) __nonnull ((1));
+static void
+session_eval (const char *name, bool restore)
+{
+  char *expression = session_expression (restore);
+  int phase;
+
+  if (expression == NULL)
+    return;
+
+  phase = trace_begin (restore ? "restore-session" : "save-session");
+  eval_in_daemon (name, expression, false);
+
+  free (expression);
+  trace_end (phase);
+}
+
+#define save_session(name) session_eval (name, false)
+#define restore_session(name) session_eval (name, true)
+
+/* A Lisp expression that is true when the daemon is in use: it has
+   clients besides the one evaluating it or unsaved file buffers.  */
+#define DAEMON_BUSY                                                           \
+  "(or (cdr server-clients)"                                                  \
+  " (let (m) (dolist (b (buffer-list) m)"                                     \
+  " (and (buffer-file-name b) (buffer-modified-p b) (setq m t)))))"
+
+/* Stop the daemon, or with ONLY_IF_IDLE, only if it is not in use.
+   Return whether it was stopped.  */
+static bool
+stop_daemon (bool only_if_idle)
+{
+  char *spare_name;
+
+  trace_begin ("stop");
+
+  if (unlikely (!socket_exists (socket_name)))
+    {
+      if (!only_if_idle)
+        fputs ("Emacs daemon is not running.\n", stderr);
+      return false;
+    }
+
+  if (only_if_idle)
+    {
+      /* Check, save the session and kill at once, so that no client
+         sneaks in between and a busy daemon keeps no session file.  */
+      char *save = session_expression (false);
+      char *expression = xmalloc (strlen ("(if " DAEMON_BUSY " 'busy  (kill-emacs))")
+                                  + (save != NULL ? strlen (save) : 0) + 1);
+      char *output;
+      bool busy;
+
+      xsprintf (expression, "(if " DAEMON_BUSY " 'busy %s (kill-emacs))",
+                save != NULL ? save : "");
+      output = eval_to_string (socket_name, expression);
+      busy = output != NULL && strstr (output, "busy") != NULL;
+
+      free (output);
+      free (expression);
+      free (save);
+      if (busy)
+        return false;
+    }
+  else
+    {
+      save_session (socket_name);
+      if (unlikely (eval_in_daemon (socket_name, "(kill-emacs)", false) != EXIT_SUCCESS))
+        die (EXIT_FAILURE, "Failed to stop Emacs daemon.\n");
+    }
+
+  /* A pre-warmed spare is useless without the daemon it stands by for.  */
+  spare_name = socket_file (".spare");
+  if (daemon_accepts_connections (spare_name))
+    eval_in_daemon (spare_name, "(kill-emacs)", false);
+  free (spare_name);
+
+  record_stats (STATS_STOP);
+  return true;
+}
+
+/* Idle eviction.  With an idle timeout or an RSS cap every started
+   daemon gets a watchdog, a detached tem --watchd, that stops the
+   daemon once it has not been in use for the idle timeout, and asks it
+   to collect garbage when its resident set grows over the cap and
+   restarts it if that did not help and it is not in use.  The next
+   invocation starts a daemon again as usual.  */
+
+/* In milliseconds and bytes respectively, zero means no limit.  */
+static uint64_t idle_timeout = 0;
+static uint64_t max_rss = 0;
+
+/* The longest time between two looks at the daemon, in milliseconds.  */
+#define WATCH_INTERVAL 60000
+
+/* Return the size in bytes that the line starting with FIELD of the
+   file NAME in /proc/PID reports in kB, or zero if unknown.  */
+static uint64_t proc_size (pid_t pid, const char *name, const char *field) __nonnull ((2, 3)) __warn_unused_result;
+static uint64_t
+proc_size (pid_t pid, const char *name, const char *field)
+{
+  char file_name[sizeof ("/proc//smaps_rollup") + INT_STRLEN_BOUND (pid_t)];
+  char *line = NULL;
+  size_t size = 0;
+  uint64_t value = 0;
+  FILE *stream;
+
+  xsprintf (file_name, "/proc/%d/%s", pid, name);
+  stream = fopen (file_name, "re");
+  if (stream == NULL)
+    return 0;
+
+  while (getline (&line, &size, stream) >= 0)
+    if (strprefix (line, field))
+      {
+        value = strtoumax (line + strlen (field), NULL, 10) * 1024;
+        break;
+      }
+
+  free (line);
+  fclose (stream);
+  return value;
+}
+
+/* Return the resident set size of PID in bytes, or zero if unknown.  */
+static uint64_t resident_set_size (pid_t pid) __warn_unused_result;
+static uint64_t
+resident_set_size (pid_t pid)
+{
+  return proc_size (pid, "status", "VmRSS:");
+}
+
+/* Append the options that the stops and restarts by the watchdog have
+   to honour to V, which has C elements, and return the new number of
+   them.  */
+static int daemon_options (char **v, int c) __nonnull ((1)) __warn_unused_result;
+static int
+daemon_options (char **v, int c)
+{
+  c = placement_options (v, c);
+  if (!keep_session)
+    v[c++] = "--no-session";
+  if (socket_activation)
+    v[c++] = "--socket-activation";
+  return c;
+}
+
+/* Start the watchdog of the daemon listening on socket_name, unless
+   there is nothing for it to do.  It waits for the daemon itself.  */
+static void
+spawn_watchdog (void)
+{
+  char idle[sizeof ("--idle-timeout=.000") + INT_STRLEN_BOUND (uint64_t)];
+  char rss[sizeof ("--max-rss=") + INT_STRLEN_BOUND (uint64_t)];
+  char *name = NULL;
+  char *v[12];
+  int c = 0;
+  int null;
+  int phase;
+
+  if (idle_timeout == 0 && max_rss == 0)
+    return;
+
+  phase = trace_begin ("watchdog");
+  xsprintf (idle, "--idle-timeout=%" PRIu64 ".%03" PRIu64,
+            idle_timeout / 1000, idle_timeout % 1000);
+  xsprintf (rss, "--max-rss=%" PRIu64, max_rss);
+
+  v[c++] = "tem";
+  v[c++] = idle;
+  v[c++] = rss;
+  /* For the stops and restarts.  */
+  c = daemon_options (v, c);
+  if (daemon_name != NULL)
+    {
+      name = xmalloc (strlen ("--name=") + strlen (daemon_name) + 1);
+      xsprintf (name, "--name=%s", daemon_name);
+      v[c++] = name;
+    }
+  v[c++] = "--watchd";
+  v[c] = NULL;
+
+  null = open (_PATH_DEVNULL, O_RDWR | O_CLOEXEC);
+  trace_pid (phase, xspawnp ("/proc/self/exe", v, true, null));
+  if (null >= 0)
+    close (null);
+  free (name);
+  trace_end (phase);
+}
+
+/* Restart the daemon with tem --restartd and wait for it.  */
+static void
+restart_idle_daemon (void)
+{
+  char *name = NULL;
+  char *v[10];
+  int c = 0;
+  int status;
+
+  v[c++] = "tem";
+  c = daemon_options (v, c);
+  if (daemon_name != NULL)
+    {
+      name = xmalloc (strlen ("--name=") + strlen (daemon_name) + 1);
+      xsprintf (name, "--name=%s", daemon_name);
+      v[c++] = name;
+    }
+  v[c++] = "--restartd";
+  v[c] = NULL;
+
+  status = wait_program_termination (xspawnp ("/proc/self/exe", v, false, -1));
+  if (!EXITED_SUCCESSFULLY (status))
+    error (0, 0, "Failed to restart Emacs daemon.");
+  free (name);
+}
+
+/* Watch the daemon listening on socket_name, following it across
+   restarts, until it is stopped.  Only one watchdog runs per daemon.  */
+static __noreturn void
+watch_daemon (void)
+{
+  char *lock_name = socket_file (".watch");
+  int lock = open (lock_name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  uint64_t started = monotonic_ns ();
+  uint64_t idle_since = 0;
+  struct pollfd daemon = { .fd = -1, .events = POLLIN };
+  pid_t pid = 0;
+  bool seen = false;
+  int interval;
+
+  if (unlikely (lock < 0))
+    edie (errno, "open(%s)", lock_name);
+  if (flock (lock, LOCK_EX | LOCK_NB) != 0)
+    exit (EXIT_SUCCESS);
+  free (lock_name);
+
+  interval = idle_timeout != 0 && idle_timeout / 4 < WATCH_INTERVAL ? idle_timeout / 4 : WATCH_INTERVAL;
+  if (interval < 1000)
+    interval = 1000;
+
+  while (true)
+    {
+      int fd;
+      pid_t current;
+
+      if (!daemon_accepts_connections (socket_name))
+        {
+          /* Gone, or still starting.  */
+          if (seen || (daemon_start_timeout != 0
+                       && monotonic_ns () - started > daemon_start_timeout * 1000000))
+            exit (EXIT_SUCCESS);
+          poll (NULL, 0, 100);
+          continue;
+        }
+
+      fd = connect_to_emacs (socket_name);
+      current = fd >= 0 ? peer_pid (fd) : 0;
+      if (fd >= 0)
+        close (fd);
+      if (current != pid)
+        {
+          /* Started, or restarted by somebody.  */
+          if (daemon.fd >= 0)
+            close (daemon.fd);
+          daemon.fd = current > 0 ? pidfd_of (current) : -1;
+          pid = current;
+          idle_since = 0;
+        }
+      seen = true;
+
+      if (max_rss != 0 && pid > 0 && resident_set_size (pid) > max_rss)
+        {
+          free (eval_to_string (socket_name,
+                                "(progn (garbage-collect)"
+                                " (when (fboundp 'malloc-trim) (malloc-trim)) nil)"));
+          if (resident_set_size (pid) > max_rss)
+            {
+              char *output = eval_to_string (socket_name, "(if " DAEMON_BUSY " 'busy 'idle)");
+
+              if (output != NULL && strstr (output, "idle") != NULL)
+                restart_idle_daemon ();
+              free (output);
+            }
+        }
+
+      if (idle_timeout != 0)
+        {
+          char *output = eval_to_string (socket_name, "(if " DAEMON_BUSY " 'busy 'idle)");
+          uint64_t now = monotonic_ns ();
+
+          if (output == NULL || strstr (output, "idle") == NULL)
+            idle_since = 0;
+          else if (idle_since == 0)
+            idle_since = now;
+          else if (now - idle_since >= idle_timeout * 1000000 && stop_daemon (true))
+            exit (EXIT_SUCCESS);
+          free (output);
+        }
+
+      while (poll (&daemon, 1, interval) < 0 && errno == EINTR)
+        continue;
+    }
+}
+
+/* Daemon health.  --status [--json] [--watch=SECONDS] reports what the
+   daemon costs and how well it answers: its PID, uptime, resident and
+   proportional set sizes from /proc, the buffers, frames and clients it
+   has, the garbage collections it has done so far and the time they
+   took, and how long a round trip to it takes, or that it does not
+   respond within the response timeout, STATUS_TIMEOUT unless given.
+   With --watch it does so every SECONDS until interrupted, one JSON
+   line per sample with --json.  */
+
+/* How long --status waits for the daemon to respond by default, in
+   milliseconds.  */
+#define STATUS_TIMEOUT 5000
+
+/* The buffers, visible frames, clients other than us, garbage
+   collections and seconds spent in them.  */
+#define DAEMON_STATUS                                                         \
+  "(list (length (buffer-list))"                                              \
+  " (let ((n 0)) (dolist (f (frame-list) n)"                                  \
+  " (unless (or (eq f terminal-frame) (frame-parameter f 'tem-pool))"         \
+  " (setq n (1+ n)))))"                                                       \
+  " (1- (length server-clients)) gcs-done gc-elapsed)"
+
+struct daemon_status
+{
+  pid_t pid;
+  double uptime;
+  uint64_t rss;
+  uint64_t pss;
+  uint64_t latency;
+  bool responding;
+  bool counted;
+  long buffers;
+  long frames;
+  long clients;
+  long gcs;
+  double gc_elapsed;
+};
+
+/* Return for how many seconds PID has been running, or a negative
+   number if unknown.  */
+static double process_uptime (pid_t pid) __warn_unused_result;
+static double
+process_uptime (pid_t pid)
+{
+  char file_name[sizeof ("/proc//stat") + INT_STRLEN_BOUND (pid_t)];
+  char buffer[1024];
+  unsigned long long start;
+  double uptime;
+  char *p;
+  ssize_t n;
+  int fd;
+
+  xsprintf (file_name, "/proc/%d/stat", pid);
+  fd = open (file_name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  n = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  if (n <= 0)
+    return -1;
+  buffer[n] = '\0';
+
+  /* The command name may contain anything, so the fields are counted
+     from its closing parenthesis.  The start time is the 22nd.  */
+  p = strrchr (buffer, ')');
+  if (p == NULL)
+    return -1;
+  for (int field = 2; field < 22 && p != NULL; field++)
+    p = strchr (p + 1, ' ');
+  if (p == NULL || sscanf (p, " %llu", &start) != 1)
+    return -1;
+
+  fd = open ("/proc/uptime", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  n = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  if (n <= 0)
+    return -1;
+  buffer[n] = '\0';
+  if (sscanf (buffer, "%lf", &uptime) != 1)
+    return -1;
+
+  return uptime - (double) start / sysconf (_SC_CLK_TCK);
+}
+
+/* Sample the daemon into STATUS.  Return false if it is not running.
+   A daemon that is stalled, by a long garbage collection say, is
+   running but not responding, and then only what the kernel tells
+   about it is known.  */
+static bool sample_status (struct daemon_status *status) __nonnull ((1)) __warn_unused_result;
+static bool
+sample_status (struct daemon_status *status)
+{
+  uint64_t start = monotonic_ns ();
+  int fd = connect_to_emacs (socket_name);
+  char *output;
+
+  memset (status, 0, sizeof (*status));
+  if (fd < 0)
+    return false;
+
+  status->pid = peer_pid (fd);
+  if (status->pid <= 0)
+    {
+      close (fd);
+      return false;
+    }
+
+  status->uptime = process_uptime (status->pid);
+  status->rss = resident_set_size (status->pid);
+  status->pss = proc_size (status->pid, "smaps_rollup", "Pss:");
+
+  if (eval_on_connection (fd, "nil", false) != EXIT_SUCCESS)
+    return true;
+  status->latency = monotonic_ns () - start;
+  status->responding = true;
+
+  output = eval_to_string (socket_name, DAEMON_STATUS);
+  status->counted = (output != NULL
+                     && sscanf (output, "(%ld %ld %ld %ld %lf)",
+                                &status->buffers, &status->frames, &status->clients,
+                                &status->gcs, &status->gc_elapsed) == 5);
+  free (output);
+
+  return true;
+}
+
+/* Print S to STREAM as a JSON string.  */
+static void print_json_string (FILE *stream, const char *s) __nonnull ((1, 2));
+static void
+print_json_string (FILE *stream, const char *s)
+{
+  putc ('"', stream);
+  for (; *s != '\0'; s++)
+    if (*s == '"' || *s == '\\')
+      fprintf (stream, "\\%c", *s);
+    else if ((unsigned char) *s < ' ')
+      fprintf (stream, "\\u%04x", *s);
+    else
+      putc (*s, stream);
+  putc ('"', stream);
+}
+
+static void print_status (const struct daemon_status *status, bool running, bool json) __nonnull ((1));
+static void
+print_status (const struct daemon_status *status, bool running, bool json)
+{
+  if (json)
+    {
+      fputs ("{\"socket\":", stdout);
+      print_json_string (stdout, socket_name);
+      printf (",\"running\":%s", running ? "true" : "false");
+      if (running)
+        {
+          printf (",\"pid\":%d", status->pid);
+          if (status->uptime >= 0)
+            printf (",\"uptime_s\":%.0f", status->uptime);
+          if (status->rss != 0)
+            printf (",\"rss_bytes\":%" PRIu64, status->rss);
+          if (status->pss != 0)
+            printf (",\"pss_bytes\":%" PRIu64, status->pss);
+          if (status->counted)
+            printf (",\"buffers\":%ld,\"frames\":%ld,\"clients\":%ld"
+                    ",\"gcs\":%ld,\"gc_elapsed_s\":%.3f",
+                    status->buffers, status->frames, status->clients,
+                    status->gcs, status->gc_elapsed);
+          printf (",\"responding\":%s", status->responding ? "true" : "false");
+          if (status->responding)
+            printf (",\"latency_ns\":%" PRIu64, status->latency);
+        }
+      puts ("}");
+      return;
+    }
+
+  if (!running)
+    {
+      puts ("Emacs daemon is not running.");
+      return;
+    }
+
+  printf ("%-12s %d\n", "PID:", status->pid);
+  if (status->uptime >= 0)
+    printf ("%-12s %.0f s\n", "Uptime:", status->uptime);
+  if (status->rss != 0)
+    printf ("%-12s %" PRIu64 " kB\n", "RSS:", status->rss / 1024);
+  if (status->pss != 0)
+    printf ("%-12s %" PRIu64 " kB\n", "PSS:", status->pss / 1024);
+  if (status->counted)
+    {
+      printf ("%-12s %ld\n", "Buffers:", status->buffers);
+      printf ("%-12s %ld\n", "Frames:", status->frames);
+      printf ("%-12s %ld\n", "Clients:", status->clients);
+      printf ("%-12s %ld (%.3f s)\n", "GCs:", status->gcs, status->gc_elapsed);
+    }
+  if (status->responding)
+    printf ("%-12s %.3f ms\n", "Latency:", status->latency / 1e6);
+  else
+    printf ("%-12s not responding\n", "Latency:");
+}
+
+static __noreturn void
+report_status (int argc, char **argv)
+{
+  bool json = false;
+  uint64_t interval = 0;
+
+  for (int i = 1; i < argc; i++)
+    if (streq (argv[i], "--json"))
+      json = true;
+    else if (strprefix (argv[i], "--watch="))
+      {
+        interval = parse_seconds (argv[i], argv[i] + strlen ("--watch="));
+        if (unlikely (interval == 0))
+          edie (EINVAL, "%s", argv[i]);
+      }
+    else
+      die (EXIT_FAILURE, "Usage: tem --status [--json] [--watch=SECONDS]\n");
+
+  if (response_timeout == 0)
+    response_timeout = STATUS_TIMEOUT;
+
+  while (true)
+    {
+      struct daemon_status status;
+      bool running = sample_status (&status);
+
+      print_status (&status, running, json);
+      if (interval == 0)
+        exit (running ? EXIT_SUCCESS : EXIT_FAILURE);
+
+      if (!json)
+        putchar ('\n');
+      fflush (stdout);
+      poll (NULL, 0, interval > INT_MAX ? INT_MAX : (int) interval);
+    }
+}
+
+/* Restart the daemon without a window in which there is no socket to
+   connect to.  The new daemon is started on a temporary socket (or a
+   pre-warmed spare is taken), then its socket is atomically renamed over
+   socket_name and only after that the old daemon is killed, through a
+   connection opened before the rename.  The old daemon is told another
+   socket name first, so that its exit leaves the new socket alone.  */
+static __noreturn void
+restart_daemon (int argc, char **argv)
+{
+  int old_socket = -1;
+  char *spare_name = socket_file (".spare");
+  char *standby_name;
+  char *dead_name;
+  char *expression;
+  char *literal;
+  int lock;
+
+  trace_begin ("restart");
+  lock = lock_daemon ();
+
+  if (daemon_accepts_connections (spare_name))
+    {
+      standby_name = spare_name;
+      spare_name = NULL;
+    }
+  else
+    {
+      standby_name = xmalloc (strlen (socket_name) + 1 + INT_STRLEN_BOUND (pid_t) + 1);
+      xsprintf (standby_name, "%s.%d", socket_name, getpid ());
+      start_daemon (standby_name, argc, argv);
+    }
+
+  /* An activated daemon accepts connections before it is ready, keep
+     the old one serving until then.  */
+  if (socket_activation
+      && unlikely (eval_in_daemon (standby_name, "t", false) != EXIT_SUCCESS))
+    die (EXIT_FAILURE, "Failed to start daemon.\n");
+
+  if (socket_exists (socket_name))
+    {
+      save_session (socket_name);
+
+      /* The old daemon removes the file named by server-name on its way
+         out, which is the new daemon's socket by then, so it is given a
+         name nothing listens on.  */
+      dead_name = xmalloc (strlen (socket_name) + strlen (".dead") + 1);
+      xsprintf (dead_name, "%s.dead", socket_name);
+      literal = lisp_string (dead_name);
+      expression = xmalloc (strlen ("(setq server-name )") + strlen (literal) + 1);
+      xsprintf (expression, "(setq server-name %s)", literal);
+      if (unlikely (eval_in_daemon (socket_name, expression, false) != EXIT_SUCCESS))
+        die (EXIT_FAILURE, "Failed to stop Emacs daemon.\n");
+      old_socket = connect_to_emacs (socket_name);
+      free (expression);
+      free (literal);
+      free (dead_name);
+    }
+
+  if (unlikely (rename (standby_name, socket_name) != 0))
+    edie (errno, "rename(%s, %s)", standby_name, socket_name);
+
+  /* Let the new daemon know its socket name, so that it cleans up the
+     right file when it is stopped.  */
+  literal = lisp_string (socket_name);
+  expression = xmalloc (strlen ("(setq server-name )") + strlen (literal) + 1);
+  xsprintf (expression, "(setq server-name %s)", literal);
+  eval_in_daemon (socket_name, expression, false);
+  free (expression);
+  free (literal);
+
+  if (old_socket >= 0
+      && unlikely (eval_on_connection (old_socket, "(kill-emacs)", false) != EXIT_SUCCESS))
+    die (EXIT_FAILURE, "Failed to stop Emacs daemon.\n");
+
+  restore_session (socket_name);
+  unlock_daemon (lock);
+  record_stats (STATS_RESTART);
+  spawn_watchdog ();
+
+  /* Start the next spare in background, it is not waited for.  */
+  if (keep_spare)
+    {
+      if (spare_name == NULL)
+        spare_name = socket_file (".spare");
+      spawn_daemon (spare_name, argc, argv);
+    }
+
+  exit (EXIT_SUCCESS);
+}
+
+static __noreturn void
+usage (int status)
+{
+  fputs ("\
+Usage: tes [OPTIONS] FILE...\n\
+Tiny Emacs Manager.\n\
+Every FILE can be either just a FILENAME or [+LINE[:COLUMN]] FILENAME.\n\
+FILE \"-\" opens standard input, which is followed while it grows.\n\
+\n\
+The following OPTIONS are accepted:\n\
+  --help                  Print this usage information message.\n\
+  --version               Print version.\n\
+  --startd                Start the emacs daemon.\n\
+  --restartd              Restart the already runned emacs daemon.\n\
+  --stopd                 Stop the emacs daemon.\n\
+  --no-session            Do not save the visited files when the daemon is\n\
+                          stopped or restarted, nor restore them when it\n\
+                          is started.\n\
+  --idle-timeout=SECONDS  Stop the daemon once it has had no clients and no\n\
+                          unsaved files for SECONDS (default: 0, never).\n\
+                          Also set by TEM_IDLE_TIMEOUT.\n\
+  --max-rss=SIZE          Collect garbage in the daemon when its resident\n\
+                          set exceeds SIZE bytes, and restart it when that\n\
+                          does not help and it is not in use (default: 0,\n\
+                          no limit).  Also set by TEM_MAX_RSS.\n\
+  --socket-activation     Bind the socket of a started daemon before Emacs\n\
+                          loads the init files and pass it to Emacs as\n\
+                          systemd does, so that clients do not wait for\n\
+                          the daemon to start, only for the answer.  Emacs\n\
+                          has to be built with libsystemd.  Also set by\n\
+                          TEM_SOCKET_ACTIVATION=1.\n\
+  --frame-pool[=N]        Keep N hidden frames (default: 2) per graphical\n\
+                          display in the daemon.  Without a terminal, show\n\
+                          a frame already visible on $DISPLAY, or else one\n\
+                          from the pool.  Inside Emacs (INSIDE_EMACS set),\n\
+                          open the files in the selected frame.  Also set\n\
+                          by TEM_FRAME_POOL=N.\n\
+  --cpu-weight=WEIGHT     Start the daemon in a cgroup of its own under\n\
+  --io-weight=WEIGHT      the delegated user@UID.service with these\n\
+  --memory-high=SIZE      cpu.weight, io.weight (1 to 10000, default 100)\n\
+                          and memory.high.  Without delegation the weights\n\
+                          are applied as nice and I/O priority instead.\n\
+  --cpus=LIST             Run the daemon on the CPUs in LIST, like 0-3,8.\n\
+  --warm[=JOBS]           Compile the Lisp files of packages whose .elc is\n\
+                          missing or out of date with JOBS batch Emacs\n\
+                          workers (default: the number of online CPUs).\n\
+                          With --restartd this is done before the new\n\
+                          daemon is started.\n\
+  --dump                  Dump Emacs with the init files loaded, to start\n\
+                          daemons from until the init files or Emacs\n\
+                          change, when the image is rebuilt.\n\
+  --name=NAME             Use the daemon named NAME instead of the default\n\
+                          one.  Every daemon is started when first used.\n\
+  --project               Use the daemon of the project the first FILE\n\
+                          belongs to, found by looking for .git upwards.\n\
+                          Files outside of projects go to the default one.\n\
+  --spare                 Make --restartd start a pre-warmed spare daemon\n\
+                          to be swapped in by the next --restartd.\n\
+  --large-file=SIZE       Show only the first 16M of files larger than SIZE\n\
+                          bytes (K, M and G suffixes allowed), literally\n\
+                          and read-only, instead of visiting them\n\
+                          (default: 256M, 0 disables).  Also set by\n\
+                          TEM_LARGE_FILE.\n\
+  --from-stdin            Also open the locations read from stdin, one per\n\
+                          line as FILE:LINE[:COLUMN][:TEXT], the format of\n\
+                          grep -n and compiler errors, or +LINE[:COLUMN]\n\
+                          FILE.  The first 256 are opened like FILE\n\
+                          arguments, the rest in the background, 256 at\n\
+                          a time.\n\
+  --response-timeout=SECONDS\n\
+                          Fall back to the alternate editor if the daemon\n\
+                          does not answer within SECONDS (default: 0,\n\
+                          wait forever).  Once it has answered, a new\n\
+                          frame is waited for.\n\
+  --stats                 Print latency percentiles of recent invocations.\n\
+  --status [--json] [--watch=SECONDS]\n\
+                          Print the daemon's PID, uptime, memory use,\n\
+                          buffers, frames, clients, garbage collections\n\
+                          and response latency, every SECONDS with\n\
+                          --watch.  A daemon that does not respond within\n\
+                          --response-timeout (default: 5) is reported as\n\
+                          not responding.\n\
+  --trace=FILE            Append timings of this invocation's phases to\n\
+                          FILE as a JSON line.  Also set by TEM_TRACE.\n\
+  --start-timeout=SECONDS How long to wait for a started daemon to accept\n\
+                          connections (default: 60, 0 means forever).\n\
+\n\
+Options --startd, --restartd and --dump pass the rest arguments to emacs.\n\
+The sockets are kept in /tmp/.emacs-sockets, or in the existing directory\n\
+TEM_SOCKET_DIR if it is set.\n\
+\n\
+The following emacsclient OPTIONS are understood as well:\n\
+  -n, --no-wait           Open the files in the frame the daemon has\n\
+                          selected instead of on this terminal, and do not\n\
+                          wait for the server to return.  While the\n\
+                          daemon is busy the files are queued, and opened\n\
+                          together once it is free.  Ignored with -e.\n\
+  -q, --quiet             Do not display messages on success.\n\
+  -u, --suppress-output   Do not display return values from the server.\n\
+  -e, --eval              Evaluate the FILE arguments as ELisp expressions.\n\
+  -a, --alternate-editor=EDITOR\n\
+                          Editor to fallback to if the server is not\n\
+                          running.  Overrides ALTERNATE_EDITOR.\n\
+  -t, -nw, --tty, -c, --create-frame\n\
+                          Accepted for compatibility, a new terminal\n\
+                          frame is always created.\n\
+",
+         (status == EXIT_SUCCESS ? stdout : stderr));
+
+  exit (status);
+}
+
+static __noreturn void
+version (void)
+{
+  puts ("Tiny Emacs Manager 1.0");
+  exit (EXIT_SUCCESS);
+}
+
+int
+main (int argc, char **argv)
+{
+  int i;
+  int phase;
+  int action = 0;
+  bool running;
+  const char *sockets_directory;
+  const char *large_file;
+  const char *limit;
+
+  trace_start = monotonic_ns ();
+  trace_file = getenv ("TEM_TRACE");
+  large_file = getenv ("TEM_LARGE_FILE");
+  if (large_file != NULL && *large_file != '\0')
+    large_file_threshold = parse_size ("TEM_LARGE_FILE", large_file);
+  limit = getenv ("TEM_IDLE_TIMEOUT");
+  if (limit != NULL && *limit != '\0')
+    idle_timeout = parse_seconds ("TEM_IDLE_TIMEOUT", limit);
+  limit = getenv ("TEM_MAX_RSS");
+  if (limit != NULL && *limit != '\0')
+    max_rss = parse_size ("TEM_MAX_RSS", limit);
+  limit = getenv ("TEM_FRAME_POOL");
+  if (limit != NULL && *limit != '\0')
+    frame_pool = parse_frame_pool ("TEM_FRAME_POOL", limit);
+  limit = getenv ("TEM_SOCKET_ACTIVATION");
+  socket_activation = limit != NULL && *limit != '\0' && !streq (limit, "0");
+
+  uid = xgeteuid ();
+
+  for (i = 1; i < argc; i++)
+    {
+      char *arg = argv[i];
+
+      if (unlikely (arg[0] != '-' || arg[1] != '-' || arg[2] == '\0'))
+        continue;
+      arg += 2;
+
+      if (streq (arg, "help"))
+        usage (EXIT_SUCCESS);
+      else if (streq (arg, "version"))
+        version ();
+      else if (strprefix (arg, "trace="))
+        trace_file = arg + strlen ("trace=");
+      else if (strprefix (arg, "name="))
+        {
+          daemon_name = arg + strlen ("name=");
+          if (unlikely (*daemon_name == '\0' || strchr (daemon_name, '/') != NULL))
+            edie (EINVAL, "%s", argv[i]);
+        }
+      else if (streq (arg, "project"))
+        route_by_project = true;
+      else if (streq (arg, "spare"))
+        keep_spare = true;
+      else if (streq (arg, "from-stdin"))
+        from_stdin = true;
+      else if (streq (arg, "no-session"))
+        keep_session = false;
+      else if (streq (arg, "socket-activation"))
+        socket_activation = true;
+      else if (streq (arg, "frame-pool"))
+        frame_pool = FRAME_POOL_SIZE;
+      else if (strprefix (arg, "frame-pool="))
+        frame_pool = parse_frame_pool (argv[i], arg + strlen ("frame-pool="));
+      else if (parse_warm (arg))
+        ;
+      else if (strprefix (arg, "idle-timeout="))
+        idle_timeout = parse_seconds (argv[i], arg + strlen ("idle-timeout="));
+      else if (strprefix (arg, "max-rss="))
+        max_rss = parse_size (argv[i], arg + strlen ("max-rss="));
+      else if (strprefix (arg, "cpu-weight="))
+        cpu_weight = parse_weight (argv[i], arg + strlen ("cpu-weight="));
+      else if (strprefix (arg, "io-weight="))
+        io_weight = parse_weight (argv[i], arg + strlen ("io-weight="));
+      else if (strprefix (arg, "memory-high="))
+        memory_high = parse_size (argv[i], arg + strlen ("memory-high="));
+      else if (strprefix (arg, "cpus="))
+        {
+          cpu_set_t set;
+          cpu_list = arg + strlen ("cpus=");
+          parse_cpu_list (cpu_list, &set);
+        }
+      else if (strprefix (arg, "large-file="))
+        large_file_threshold = parse_size (argv[i], arg + strlen ("large-file="));
+      else if (strprefix (arg, "response-timeout="))
+        response_timeout = parse_seconds (argv[i], arg + strlen ("response-timeout="));
+      else if (strprefix (arg, "start-timeout="))
+        daemon_start_timeout = parse_seconds (argv[i], arg + strlen ("start-timeout="));
+      else if (streq (arg, "startd") || streq (arg, "restartd") || streq (arg, "stopd")
+               || streq (arg, "stats") || streq (arg, "dump") || streq (arg, "watchd")
+               || streq (arg, "listend") || streq (arg, "placed") || streq (arg, "drain")
+               || streq (arg, "status"))
+        {
+          /* The rest of arguments belong to the action.  */
+          action = i;
+          break;
+        }
+      else
+        continue;
+
+      remove_argument (&argc, argv, i--);
+    }
+
+  /* --restartd --warm compiles before the new daemon is started.  */
+  if (action != 0 && streq (argv[action], "--restartd"))
+    for (i = action + 1; i < argc; i++)
+      if (strprefix (argv[i], "--") && parse_warm (argv[i] + 2))
+        remove_argument (&argc, argv, i--);
+
+  if (trace_file != NULL && *trace_file == '\0')
+    trace_file = NULL;
+  if (trace_file != NULL)
+    {
+      trace_owner = getpid ();
+      atexit (write_trace);
+    }
+
+  phase = trace_begin ("setup");
+  if (daemon_name == NULL && route_by_project)
+    daemon_name = project_daemon_name (argc, argv);
+
+  sockets_directory = getenv ("TEM_SOCKET_DIR");
+  if (sockets_directory == NULL || *sockets_directory != '/')
+    sockets_directory = EMACS_SOCKET_DIRECTORY;
+  if (unlikely (strlen (sockets_directory) + 1 + INT_STRLEN_BOUND (uid_t)
+                >= sizeof (socket_directory_buffer)))
+    edie (ENAMETOOLONG, "TEM_SOCKET_DIR=%s", sockets_directory);
+  socket_directory = socket_directory_buffer;
+  xsprintf (socket_directory, "%s/%u", sockets_directory, uid);
+  if (unlikely (daemon_name != NULL
+                && (strlen (socket_directory) + strlen ("/socket-") + strlen (daemon_name)
+                    >= sizeof (socket_name_buffer))))
+    edie (ENAMETOOLONG, "--name=%s", daemon_name);
+  socket_name = socket_name_buffer;
+  xsprintf (socket_name, "%s/socket%s%s", socket_directory,
+            daemon_name != NULL ? "-" : "", daemon_name != NULL ? daemon_name : "");
+  trace_end (phase);
+
+  /* A warm invocation finds its daemon at once, and the directories
+     need to be set up only when it does not.  */
+  if (action == 0 && warm_jobs == 0)
+    {
+      phase = trace_begin ("connect");
+      emacs_socket = connect_to_own_daemon (socket_name);
+      trace_end (phase);
+    }
+  if (emacs_socket < 0)
+    {
+      char *slash = strrchr (socket_directory, '/');
+      struct stat sb;
+
+      phase = trace_begin ("setup");
+      /* A directory given by TEM_SOCKET_DIR is the user's own.  */
+      if (streq (sockets_directory, EMACS_SOCKET_DIRECTORY))
+        {
+          *slash = '\0';
+          xmkdir (socket_directory, 00777);
+          *slash = '/';
+        }
+      xmkdir (socket_directory, 00700);
+
+      /* Anybody can create it in the shared directory before us.  */
+      if (unlikely (lstat (socket_directory, &sb) != 0))
+        edie (errno, "stat(%s)", socket_directory);
+      if (unlikely (sb.st_uid != uid))
+        die (EXIT_FAILURE, "The socket directory does not belong to us.\n");
+      trace_end (phase);
+    }
+
+  if (warm_jobs != 0)
+    {
+      bool warmed = warm_packages ();
+
+      if (action == 0 && argc == 1)
+        exit (warmed ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+  if (action != 0)
+    {
+      char *arg = argv[action] + 2;
+
+      if (streq (arg, "startd"))
+        {
+          spawn_watchdog ();
+          exec_daemon (socket_name, argc - action, argv + action);
+        }
+      if (streq (arg, "watchd"))
+        watch_daemon ();
+      if (streq (arg, "listend"))
+        exec_listening_daemon (argc - action, argv + action);
+      if (streq (arg, "placed"))
+        exec_placed_daemon (argc - action, argv + action);
+      if (streq (arg, "drain"))
+        drain_spool (argc - action, argv + action);
+      if (streq (arg, "restartd"))
+        restart_daemon (argc - action, argv + action);
+      if (streq (arg, "stopd"))
+        {
+          stop_daemon (false);
+          exit (EXIT_SUCCESS);
+        }
+      if (streq (arg, "stats"))
+        print_stats ();
+      if (streq (arg, "status"))
+        report_status (argc - action, argv + action);
+      if (streq (arg, "dump"))
+        dump_emacs (argc - action, argv + action);
+    }
+
+  phase = trace_begin ("prefetch");
+  prefetch_files (argc, argv);
+  trace_end (phase);
+
+  phase = trace_begin ("probe");
+  running = emacs_socket >= 0 || socket_exists (socket_name);
+  trace_end (phase);
+
+  if (unlikely (!running))
+    {
+      int lock = lock_daemon ();
+
+      /* Another invocation might have started the daemon while we were
+         waiting for the lock.  */
+      if (!socket_exists (socket_name))
+        {
+          remove_stale_socket (socket_name);
+          start_daemon (socket_name, 0, NULL);
+          restore_session (socket_name);
+          prime_frame_pool ();
+          spawn_watchdog ();
+          client_kind = STATS_COLD;
+        }
+
+      unlock_daemon (lock);
+    }
+
+  start_client (argc, argv);
 }